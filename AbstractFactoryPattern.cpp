@@ -11,31 +11,63 @@
 // factory interface
 
 #include<iostream>
+#include<cstdint>
+#include<new>
+#include<string>
+#include<string_view>
 
+// Every ingredient any region uses. Ingredients are interned: a pizza holds the id, and the name comes
+// from a static table, so handing out an ingredient never allocates.
+enum class Ingredient : std::uint8_t
+{
+	NONE,
+	THIN_CRUST_DOUGH,
+	MARINARA_SAUCE,
+	REGGIANO_CHEESE,
+	COUNT
+};
+
+constexpr std::string_view kIngredientNames[] = { "None", "ThinCrustDough", "MarinaraSauce", "ReggianoCheese" };
+static_assert(sizeof(kIngredientNames) / sizeof(kIngredientNames[0]) == static_cast<std::size_t>(Ingredient::COUNT),
+	"every ingredient needs a name");
+
+constexpr std::string_view ingredientName(Ingredient ingredient)
+{
+	return kIngredientNames[static_cast<std::size_t>(ingredient)];
+}
+
+// Factories hold no state, so one instance per region is shared by every store and pizza of that region
 class PizzaIngredientFactory
 {
 public:
-	virtual std::string createDough() = 0;
-	virtual std::string createSauce() = 0;
-	virtual std::string createCheese() = 0;
+	virtual Ingredient createDough() const = 0;
+	virtual Ingredient createSauce() const = 0;
+	virtual Ingredient createCheese() const = 0;
 	virtual ~PizzaIngredientFactory() = default;
 };
 
 class NYPizzaIngredientFactory : public PizzaIngredientFactory
 {
 public:
-	std::string createDough() override { return std::string("ThinCrustDough"); }
-	std::string createSauce() override { return std::string("MarinaraSauce"); }
-	std::string createCheese() override { return std::string("ReggianoCheese");}
+	// Lives until the program exits
+	static const NYPizzaIngredientFactory& instance()
+	{
+		static const NYPizzaIngredientFactory factory;
+		return factory;
+	}
+	Ingredient createDough() const override { return Ingredient::THIN_CRUST_DOUGH; }
+	Ingredient createSauce() const override { return Ingredient::MARINARA_SAUCE; }
+	Ingredient createCheese() const override { return Ingredient::REGGIANO_CHEESE; }
 };
 
 class Pizza
 {
 protected:
-	std::string name_;
-	std::string sauce_;
-	std::string dough_;
-	std::string cheese_;
+	// Names are string literals, so the pizza only keeps a view of them
+	std::string_view name_;
+	Ingredient sauce_ = Ingredient::NONE;
+	Ingredient dough_ = Ingredient::NONE;
+	Ingredient cheese_ = Ingredient::NONE;
 public:
 	virtual void prepare() = 0;
 	void bake()
@@ -50,21 +82,23 @@ public:
 	{
 		std::cout << "Put Pizza in a box\n";
 	}
-	void setName(const std::string& name) { name_ = name; }
-	std::string getName() { return name_; }
+	// name must outlive the pizza
+	void setName(std::string_view name) { name_ = name; }
+	std::string_view getName() const { return name_; }
 	virtual ~Pizza() = default;
 };
 class CheesePizza : public Pizza
 {
-	PizzaIngredientFactory* ingredient_factory_;
+	const PizzaIngredientFactory* ingredient_factory_;
 public:
-	CheesePizza(PizzaIngredientFactory* factory) : ingredient_factory_(factory) {}
+	CheesePizza(const PizzaIngredientFactory* factory) : ingredient_factory_(factory) {}
 	void prepare() override
 	{
 		dough_ = ingredient_factory_->createDough();
 		sauce_ = ingredient_factory_->createSauce();
 		cheese_ = ingredient_factory_->createCheese();
-		std::cout << "Prepare " << name_ << " " << dough_ << " " << sauce_ << " " << cheese_  << "\n";
+		std::cout << "Prepare " << name_ << " " << ingredientName(dough_) << " " << ingredientName(sauce_) << " "
+			<< ingredientName(cheese_) << "\n";
 	}
 };
 
@@ -96,11 +130,12 @@ public:
 	Pizza* createPizza(const std::string& pizza_type) override
 	{
 		Pizza* pizza_ = nullptr;
-		PizzaIngredientFactory* ingredient_factory = new NYPizzaIngredientFactory();
+		const PizzaIngredientFactory* ingredient_factory = &NYPizzaIngredientFactory::instance();
 		if (pizza_type == "cheese")
 		{
 			pizza_ = new(std::nothrow) CheesePizza(ingredient_factory);
-			pizza_->setName("NewYork Style Cheese Pizza");
+			if (nullptr != pizza_)
+				pizza_->setName("NewYork Style Cheese Pizza");
 		}
 		/*else if (pizza_type == "greek")
 			pizza_ = new(std::nothrow) GreekPizza();
@@ -0,0 +1,85 @@
+// Replaces the global allocation functions with ones that count every heap allocation and the bytes
+// requested, so a benchmark can report allocations per operation. The counters are per thread: counting
+// does not make threads contend on a shared cache line, and each thread reads the difference over its
+// own work. Every form of operator new and delete is replaced (plain, sized, nothrow and aligned), so
+// new(std::nothrow) and over-aligned types are counted too.
+// Include it in one translation unit of a benchmark build only: it defines the replacement functions,
+// and a program that includes it no longer uses the standard allocation functions anywhere.
+#pragma once
+
+#include<cstddef>
+#include<cstdlib>
+#include<new>
+
+static thread_local std::size_t t_allocation_count = 0;
+static thread_local std::size_t t_allocated_bytes = 0;
+
+static void* countedAllocate(std::size_t size, std::size_t alignment) noexcept
+{
+	++t_allocation_count;
+	t_allocated_bytes += size;
+	if (size == 0)
+		size = 1;
+	if (alignment <= alignof(std::max_align_t))
+		return std::malloc(size);
+#if defined(_WIN32)
+	return _aligned_malloc(size, alignment);
+#else
+	return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+#endif
+}
+// Kept out of line: once inlined into operator delete, GCC pairs the free() with the new expression at the
+// call site and reports a false -Wmismatched-new-delete
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+static void countedFree(void* p, std::size_t alignment) noexcept
+{
+#if defined(_WIN32)
+	if (alignment > alignof(std::max_align_t))
+	{
+		_aligned_free(p);
+		return;
+	}
+#else
+	(void)alignment;
+#endif
+	std::free(p);
+}
+
+void* operator new(std::size_t size)
+{
+	if (void* p = countedAllocate(size, 0))
+		return p;
+	throw std::bad_alloc();
+}
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+	if (void* p = countedAllocate(size, static_cast<std::size_t>(alignment)))
+		return p;
+	throw std::bad_alloc();
+}
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+	return countedAllocate(size, 0);
+}
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	return countedAllocate(size, static_cast<std::size_t>(alignment));
+}
+void operator delete(void* p) noexcept
+{
+	countedFree(p, 0);
+}
+void operator delete(void* p, std::size_t) noexcept
+{
+	countedFree(p, 0);
+}
+void operator delete(void* p, std::align_val_t alignment) noexcept
+{
+	countedFree(p, static_cast<std::size_t>(alignment));
+}
+void operator delete(void* p, std::size_t, std::align_val_t alignment) noexcept
+{
+	countedFree(p, static_cast<std::size_t>(alignment));
+}
@@ -1,6 +1,7 @@
 //Lookslike it is more rigid and not following open-closed principle
-// Adding Size to the base class is not solving the problem - as the size variable once set is not carrying its
-// same behaviour to top objects while wrapping around and hence for top objects Size is always the default value TALL
+// Adding Size to the base class alone does not solve the problem: each decorator would keep its own size, left at
+// the default TALL. So decorators forward GetSize/SetSize to the beverage they wrap, the size lives in exactly one
+// object (the base beverage), and every level of the chain sees the same value.
 //While inheritance is powerful, it doesn't always lead to the most flexible or maintainable designs.
 // By Dynamically composing objects, I can add new functionality by writing new code rather than altering existing code.
 // Because I am not changing existing code, the changes of introducing bugs or causing unintended side effects in existing code
@@ -33,6 +34,42 @@
 
 #include<iostream>
 #include<string>
+#include<string_view>
+#include<chrono>
+#include<atomic>
+#include<cstddef>
+#include<cstdint>
+#include<cstdio>
+#include<cstring>
+#include<cstdlib>
+#include<fstream>
+#include<memory>
+#include<mutex>
+#include<new>
+#include<thread>
+#include<utility>
+#include<vector>
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+#include<immintrin.h>
+#endif
+#if defined(_WIN32)
+#include<windows.h>
+#endif
+
+// Ids of the base beverages and condiments, used to index pricing tables, batch orders and encoded orders
+enum class Product : std::uint8_t
+{
+	HOUSE_BLEND = 0, COUNT
+};
+enum class Condiment : std::uint8_t
+{
+	MOCHA = 0, STEAMED_MILK, COUNT
+};
+// Description of each product, and the suffix each condiment adds to the description it decorates
+constexpr std::string_view kProductNames[] = { "HouseBlend" };
+constexpr std::string_view kCondimentNames[] = { " Mocha", " SteamedMilk" };
+
+class PricingTable;
 
 class Beverages
 {
@@ -41,16 +78,94 @@ public:
 	{
 		TALL = 0, GRANDE, VENTI
 	};
-	virtual std::string getDescription()
+	virtual ~Beverages() = default;
+	// cost() and getDescription() are memoized; a cache hit is a few loads. The caches are cleared by
+	// invalidate() whenever the size changes or the wrapped beverage is replaced, and the cost is also
+	// recomputed when it is asked for against a different PricingTable than the one it was cached for.
+	// Several threads may price and describe a shared chain at once: the cached cost and the generation
+	// of its table are published together under a sequence counter (a seqlock), so a reader either gets
+	// a matching pair or recomputes. Changing a chain (SetSize, wrap) must not overlap those calls.
+	double cost();
+	// Prices the whole chain against one table, so a table swap in the middle of a call is never observed
+	double cost(const PricingTable& prices);
+	// Sizes the result first so that building the description of a whole chain costs a single allocation.
+	// The first caller builds it; a caller that finds it being built waits for it.
+	const std::string& getDescription()
 	{
-		return description_;
+		std::uint8_t state = description_state_.load(std::memory_order_acquire);
+		while (state != kDescriptionValid)
+		{
+			if (state == kDescriptionStale
+				&& description_state_.compare_exchange_weak(state, kDescriptionBuilding, std::memory_order_acquire))
+			{
+				cached_description_.clear();
+				cached_description_.reserve(descriptionLength());
+				appendDescription(cached_description_);
+				description_state_.store(kDescriptionValid, std::memory_order_release);
+				break;
+			}
+			std::this_thread::yield();
+			state = description_state_.load(std::memory_order_acquire);
+		}
+		return cached_description_;
+	}
+	// Decorators append to the caller's buffer instead of returning "inner + suffix" at every level,
+	// which would copy the inner description once per level (O(N^2) for a chain of depth N)
+	virtual void appendDescription(std::string& out)
+	{
+		out += description_;
+	}
+	virtual std::size_t descriptionLength()
+	{
+		return description_.size();
+	}
+	// Identifies the base beverage for encoding; Product::COUNT if it has no id
+	virtual Product productId() { return Product::COUNT; }
+	virtual Size GetSize() { return size_; }
+	virtual void SetSize(Size size)
+	{
+		if (size_ != size)
+		{
+			size_ = size;
+			invalidate(false);
+		}
 	}
-	virtual double cost() = 0;
-	Size GetSize() { return size_; }
-	void SetSize(Size size) { size_ = size; }
 protected:
-	std::string description_ = "Unknown_beverages";
+	virtual double computeCost(const PricingTable& prices) = 0;
+	// Clears this beverage's caches and those of every decorator wrapped around it. Invalidation walks
+	// outwards through the wrappers, so a cache hit never has to look down the chain. A beverage may be
+	// wrapped by several decorators; the first one is followed in the loop and the others recursively.
+	void invalidate(bool description)
+	{
+		for (Beverages* beverage = this; beverage != nullptr; beverage = beverage->wrappers_)
+		{
+			beverage->cached_generation_.store(0, std::memory_order_relaxed);
+			if (description)
+				beverage->description_state_.store(kDescriptionStale, std::memory_order_relaxed);
+			if (beverage->wrappers_ != nullptr)
+				for (Beverages* other = beverage->wrappers_->next_wrapper_; other != nullptr; other = other->next_wrapper_)
+					other->invalidate(description);
+		}
+	}
+	// Descriptions are string literals, so a view avoids a heap allocation per beverage and decorator
+	std::string_view description_ = "Unknown_beverages";
 	Size size_ = Size::TALL;
+	// The decorators wrapping this beverage, as an intrusive list: wrappers_ is the first of them and each
+	// decorator's next_wrapper_ is the next decorator wrapping the same beverage
+	Beverages* wrappers_ = nullptr;
+	Beverages* next_wrapper_ = nullptr;
+private:
+	friend class CondimentsDecorator;
+	static constexpr std::uint8_t kDescriptionStale = 0;
+	static constexpr std::uint8_t kDescriptionBuilding = 1;
+	static constexpr std::uint8_t kDescriptionValid = 2;
+	// Odd while a thread is writing the cached pair. Generation 0 belongs to no table and marks the
+	// cached cost as invalid.
+	std::atomic<std::uint32_t> cost_sequence_{ 0 };
+	std::atomic<std::uint64_t> cached_generation_{ 0 };
+	std::atomic<double> cached_cost_{ 0.0 };
+	std::string cached_description_;
+	std::atomic<std::uint8_t> description_state_{ kDescriptionStale };
 };
 
 /*class BeverageSize : public Beverages
@@ -75,15 +190,219 @@ public:
 	double cost() { return beverages_->cost(); } //Unnecessary method in this class, so it is not a proper inheritance
 };*/
 
+// Prices indexed by (product, size) and (condiment, size). This struct is also the file format, so a
+// pricing file is read and written in one go.
+struct PricingTableData
+{
+	static constexpr std::uint32_t kMagic = 0x54435250; // "PRCT"
+	static constexpr int kSizeCount = 3;
+	std::uint32_t magic;
+	std::uint32_t reserved;
+	double base_price[static_cast<int>(Product::COUNT)][kSizeCount];
+	double condiment_price[static_cast<int>(Condiment::COUNT)][kSizeCount];
+};
+
+// The prices in effect. current() is a single atomic load, so cost() never blocks; install() publishes a
+// new table with one atomic exchange. Replaced tables are retired rather than freed, because a cost()
+// call may still be reading them. Each reload retires one table until reclaimRetired() is called at a
+// point where no cost() can still hold one; retiredCount() reports how many are waiting.
+// Every table gets its own generation when it is constructed, so a beverage's cached cost is never
+// reused for a different table, installed or not.
+class PricingTable
+{
+public:
+	explicit PricingTable(const PricingTableData& data) : data_(data) {}
+	PricingTable(const PricingTable&) = delete;
+	PricingTable& operator=(const PricingTable&) = delete;
+
+	double basePrice(Product product, Beverages::Size size) const
+	{
+		return data_.base_price[static_cast<int>(product)][static_cast<int>(size)];
+	}
+	double condimentPrice(Condiment condiment, Beverages::Size size) const
+	{
+		return data_.condiment_price[static_cast<int>(condiment)][static_cast<int>(size)];
+	}
+	const PricingTableData& data() const { return data_; }
+	std::uint64_t generation() const { return generation_; }
+
+	static const PricingTable* current()
+	{
+		return slot().load(std::memory_order_acquire);
+	}
+	static void install(std::unique_ptr<PricingTable> table)
+	{
+		Retired& retired = retiredTables();
+		std::lock_guard<std::mutex> lock(retired.mutex);
+		const PricingTable* previous = slot().exchange(table.release(), std::memory_order_acq_rel);
+		if (previous != &compiledIn())
+			retired.tables.emplace_back(previous);
+	}
+	// Frees the tables replaced by earlier install() calls. Call it only where no thread can be inside
+	// cost() with one of them, e.g. between batches of orders or after the pricing threads have joined.
+	static void reclaimRetired()
+	{
+		Retired& retired = retiredTables();
+		std::lock_guard<std::mutex> lock(retired.mutex);
+		retired.tables.clear();
+	}
+	static std::size_t retiredCount()
+	{
+		Retired& retired = retiredTables();
+		std::lock_guard<std::mutex> lock(retired.mutex);
+		return retired.tables.size();
+	}
+	// Reads a pricing file written by save(); the table is copied into the object, so the installed prices
+	// do not depend on the file afterwards. Returns nullptr if it is missing or not a pricing table.
+	static std::unique_ptr<PricingTable> load(const std::string& path)
+	{
+		std::ifstream in(path, std::ios::binary);
+		PricingTableData data;
+		if (!in.read(reinterpret_cast<char*>(&data), sizeof(data)) || in.peek() != std::ifstream::traits_type::eof())
+			return nullptr;
+		if (data.magic != PricingTableData::kMagic)
+			return nullptr;
+		return std::unique_ptr<PricingTable>(new PricingTable(data));
+	}
+	// Writes a temporary file and renames it over path, so a reader of path sees the old file or the new
+	// one and never a partly written one
+	static bool save(const std::string& path, const PricingTableData& data)
+	{
+		std::string temporary = path + ".tmp";
+		{
+			std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+			out.write(reinterpret_cast<const char*>(&data), sizeof(data));
+			if (!out.flush())
+				return false;
+		}
+#if defined(_WIN32)
+		return MoveFileExA(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+		return std::rename(temporary.c_str(), path.c_str()) == 0;
+#endif
+	}
+	// The prices compiled into the price() functions of the beverage classes
+	static PricingTableData defaults();
+
+private:
+	struct Retired
+	{
+		std::mutex mutex;
+		std::vector<std::unique_ptr<const PricingTable>> tables;
+	};
+
+	static Retired& retiredTables()
+	{
+		static Retired retired;
+		return retired;
+	}
+	static std::uint64_t nextGeneration()
+	{
+		static std::atomic<std::uint64_t> next(1);
+		return next.fetch_add(1, std::memory_order_relaxed);
+	}
+	static const PricingTable& compiledIn()
+	{
+		static const PricingTable table(defaults());
+		return table;
+	}
+	static std::atomic<const PricingTable*>& slot()
+	{
+		static std::atomic<const PricingTable*> current(&compiledIn());
+		return current;
+	}
+
+	PricingTableData data_;
+	std::uint64_t generation_ = nextGeneration();
+};
+
+inline double Beverages::cost()
+{
+	return cost(*PricingTable::current());
+}
+
+inline double Beverages::cost(const PricingTable& prices)
+{
+	std::uint32_t sequence = cost_sequence_.load(std::memory_order_acquire);
+	if ((sequence & 1) == 0)
+	{
+		std::uint64_t generation = cached_generation_.load(std::memory_order_relaxed);
+		double cost = cached_cost_.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (generation == prices.generation() && cost_sequence_.load(std::memory_order_relaxed) == sequence)
+			return cost;
+	}
+	double cost = computeCost(prices);
+	// One writer at a time; a thread that loses the race (or saw a write in progress) just returns its result
+	if ((sequence & 1) == 0 && cost_sequence_.compare_exchange_strong(sequence, sequence + 1, std::memory_order_relaxed))
+	{
+		std::atomic_thread_fence(std::memory_order_release);
+		cached_generation_.store(prices.generation(), std::memory_order_relaxed);
+		cached_cost_.store(cost, std::memory_order_relaxed);
+		cost_sequence_.store(sequence + 2, std::memory_order_release);
+	}
+	return cost;
+}
+
 class CondimentsDecorator : public Beverages
 {
 public:
 	Beverages* beverages_ = nullptr;
-	virtual std::string getDescription() = 0;
+	virtual Condiment condimentId() = 0;
+	// A decorator must be destroyed before the beverage it wraps (OrderArena::release() guarantees this)
+	~CondimentsDecorator()
+	{
+		unlink();
+	}
+	// Replaces the wrapped beverage; use this rather than assigning beverages_ so the caches stay valid
+	void wrap(Beverages* beverages)
+	{
+		unlink();
+		beverages_ = beverages;
+		if (beverages_)
+		{
+			next_wrapper_ = beverages_->wrappers_;
+			beverages_->wrappers_ = this;
+		}
+		invalidate(true);
+	}
+	// description_ of a decorator holds only its own suffix, e.g. " Mocha"
+	void appendDescription(std::string& out)
+	{
+		beverages_->appendDescription(out);
+		out += description_;
+	}
+	std::size_t descriptionLength()
+	{
+		return beverages_->descriptionLength() + description_.size();
+	}
 	Size GetSize()
 	{
 		if (beverages_)
 			return beverages_->GetSize();
+		return size_;
+	}
+	void SetSize(Size size)
+	{
+		if (beverages_)
+			beverages_->SetSize(size);
+		else
+			Beverages::SetSize(size);
+	}
+private:
+	void unlink()
+	{
+		if (beverages_ == nullptr)
+			return;
+		for (Beverages** link = &beverages_->wrappers_; *link != nullptr; link = &(*link)->next_wrapper_)
+		{
+			if (*link == this)
+			{
+				*link = next_wrapper_;
+				break;
+			}
+		}
+		next_wrapper_ = nullptr;
 	}
 };
 
@@ -92,12 +411,20 @@ class HouseBlend : public Beverages
 public:
 	HouseBlend()
 	{
-		description_ = "HouseBlend";
+		description_ = kProductNames[static_cast<int>(Product::HOUSE_BLEND)];
 	}
-	double cost()
+	Product productId() { return Product::HOUSE_BLEND; }
+	// Compiled-in default prices. They seed the default PricingTable and are used as they are by the
+	// compile-time menu below; runtime pricing reads the installed PricingTable instead.
+	static constexpr double price(Size)
 	{
 		return 1.23;
 	}
+protected:
+	double computeCost(const PricingTable& prices)
+	{
+		return prices.basePrice(Product::HOUSE_BLEND, size_);
+	}
 };
 
 class Mocha : public CondimentsDecorator
@@ -107,28 +434,32 @@ private:
 public:
 	Mocha(Beverages* beverages)
 	{
-		beverages_ = beverages;
+		description_ = kCondimentNames[static_cast<int>(Condiment::MOCHA)];
+		wrap(beverages);
 	}
-	std::string getDescription()
+	Condiment condimentId() { return Condiment::MOCHA; }
+	static constexpr double price(Size size)
 	{
-		return beverages_->getDescription() + " Mocha";
-	}
-	double cost()
-	{
-		switch (beverages_->GetSize())
+		switch (size)
 		{
 		case Size::TALL:
-			return beverages_->cost() + 0.35;
+			return 0.35;
 			//break;
 		case Size::GRANDE:
-			return beverages_->cost() + 0.35 + 0.15;
+			return 0.35 + 0.15;
 			//break;
 		case Size::VENTI:
-			return beverages_->cost() + 0.35 + 0.15 + 0.20;
+			return 0.35 + 0.15 + 0.20;
 			//break;
 		default:
 			break;
 		}
+		return 0.35;
+	}
+protected:
+	double computeCost(const PricingTable& prices)
+	{
+		return beverages_->cost(prices) + prices.condimentPrice(Condiment::MOCHA, beverages_->GetSize());
 	} 
 
 };
@@ -140,28 +471,670 @@ private:
 public:
 	SteamedMilk(Beverages* beverage)
 	{
-		beverages_ = beverage;
+		description_ = kCondimentNames[static_cast<int>(Condiment::STEAMED_MILK)];
+		wrap(beverage);
 	}
-	std::string getDescription()
+	Condiment condimentId() { return Condiment::STEAMED_MILK; }
+	static constexpr double price(Size)
 	{
-		return beverages_->getDescription() + " SteamedMilk";
-	} 
-	double cost()
+		return 0.56;
+	}
+protected:
+	double computeCost(const PricingTable& prices)
+	{
+		return beverages_->cost(prices) + prices.condimentPrice(Condiment::STEAMED_MILK, beverages_->GetSize());
+	}
+};
+
+inline PricingTableData PricingTable::defaults()
+{
+	const Beverages::Size sizes[PricingTableData::kSizeCount] = { Beverages::Size::TALL, Beverages::Size::GRANDE, Beverages::Size::VENTI };
+	PricingTableData data{};
+	data.magic = PricingTableData::kMagic;
+	for (int size = 0; size < PricingTableData::kSizeCount; ++size)
+	{
+		data.base_price[static_cast<int>(Product::HOUSE_BLEND)][size] = HouseBlend::price(sizes[size]);
+		data.condiment_price[static_cast<int>(Condiment::MOCHA)][size] = Mocha::price(sizes[size]);
+		data.condiment_price[static_cast<int>(Condiment::STEAMED_MILK)][size] = SteamedMilk::price(sizes[size]);
+	}
+	return data;
+}
+
+// Owns every beverage and decorator of an order (or of a whole request). Objects are bump-allocated
+// contiguously from blocks that the arena keeps between orders, and release() destroys them all in
+// reverse order of creation, so outer decorators go before the beverages they wrap.
+class OrderArena
+{
+public:
+	explicit OrderArena(std::size_t block_size = 1024) : block_size_(block_size) {}
+	OrderArena(const OrderArena&) = delete;
+	OrderArena& operator=(const OrderArena&) = delete;
+	~OrderArena()
+	{
+		release();
+		while (blocks_)
+		{
+			Block* next = blocks_->next;
+			::operator delete(blocks_);
+			blocks_ = next;
+		}
+	}
+
+	template<class T, class... Args>
+	T* make(Args&&... args)
+	{
+		void* record_memory = allocate(sizeof(Destructor), alignof(Destructor));
+		void* object_memory = allocate(sizeof(T), alignof(T));
+		T* object = new(object_memory) T(std::forward<Args>(args)...);
+		destructors_ = new(record_memory) Destructor{ [](void* p) { static_cast<T*>(p)->~T(); }, object, destructors_ };
+		return object;
+	}
+
+	// Destroys every object of the order and rewinds to the first block; the blocks are kept for the next order
+	void release()
+	{
+		for (Destructor* d = destructors_; d != nullptr; d = d->previous)
+			d->destroy(d->object);
+		destructors_ = nullptr;
+		current_ = blocks_;
+		used_ = 0;
+	}
+
+private:
+	struct Block
+	{
+		Block* next;
+		std::size_t capacity;
+		char* data() { return reinterpret_cast<char*>(this + 1); }
+	};
+	struct Destructor
+	{
+		void (*destroy)(void*);
+		void* object;
+		Destructor* previous;
+	};
+
+	void* allocate(std::size_t size, std::size_t alignment)
+	{
+		while (true)
+		{
+			if (current_)
+			{
+				// Aligns the address itself: data() is only as aligned as ::operator new and the Block header
+				// allow, so an offset aligned relative to it would misalign over-aligned types
+				std::uintptr_t base = reinterpret_cast<std::uintptr_t>(current_->data());
+				std::size_t offset = static_cast<std::size_t>(((base + used_ + alignment - 1) & ~(std::uintptr_t(alignment) - 1)) - base);
+				if (offset + size <= current_->capacity)
+				{
+					used_ = offset + size;
+					return current_->data() + offset;
+				}
+			}
+			nextBlock(size + alignment);
+		}
+	}
+	// Moves on to the next kept block, or allocates one if the order outgrew the blocks we have
+	void nextBlock(std::size_t min_capacity)
+	{
+		Block** link = current_ ? &current_->next : &blocks_;
+		while (*link && (*link)->capacity < min_capacity)
+			link = &(*link)->next;
+		if (*link == nullptr)
+		{
+			std::size_t capacity = block_size_ > min_capacity ? block_size_ : min_capacity;
+			Block* block = static_cast<Block*>(::operator new(sizeof(Block) + capacity));
+			block->next = nullptr;
+			block->capacity = capacity;
+			*link = block;
+		}
+		current_ = *link;
+		used_ = 0;
+	}
+
+	std::size_t block_size_;
+	Block* blocks_ = nullptr;
+	Block* current_ = nullptr;
+	std::size_t used_ = 0;
+	Destructor* destructors_ = nullptr;
+};
+
+// Fixed menu items known at build time can be composed as types, e.g.
+// fixed_menu::Mocha<fixed_menu::SteamedMilk<fixed_menu::HouseBlend>>. Cost and description are folded by the
+// compiler: there is no heap allocation and no virtual call. FixedBeverage adapts such a type to Beverages*.
+namespace fixed_menu
+{
+	// A string that can be concatenated in a constant expression
+	template<std::size_t N>
+	struct FixedString
+	{
+		char data[N + 1] = {};
+		constexpr FixedString() = default;
+		constexpr FixedString(const char (&text)[N + 1])
+		{
+			for (std::size_t i = 0; i < N; ++i)
+				data[i] = text[i];
+		}
+		constexpr std::string_view view() const { return std::string_view(data, N); }
+	};
+	template<std::size_t M>
+	FixedString(const char (&)[M]) -> FixedString<M - 1>;
+
+	template<std::size_t A, std::size_t B>
+	constexpr FixedString<A + B> operator+(const FixedString<A>& lhs, const FixedString<B>& rhs)
+	{
+		FixedString<A + B> result;
+		for (std::size_t i = 0; i < A; ++i)
+			result.data[i] = lhs.data[i];
+		for (std::size_t i = 0; i < B; ++i)
+			result.data[A + i] = rhs.data[i];
+		return result;
+	}
+
+	struct HouseBlend
+	{
+		static constexpr auto description = FixedString("HouseBlend");
+		static constexpr double cost(Beverages::Size size) { return ::HouseBlend::price(size); }
+	};
+
+	template<class Beverage>
+	struct Mocha
+	{
+		static constexpr auto description = Beverage::description + FixedString(" Mocha");
+		static constexpr double cost(Beverages::Size size) { return Beverage::cost(size) + ::Mocha::price(size); }
+	};
+
+	template<class Beverage>
+	struct SteamedMilk
+	{
+		static constexpr auto description = Beverage::description + FixedString(" SteamedMilk");
+		static constexpr double cost(Beverages::Size size) { return Beverage::cost(size) + ::SteamedMilk::price(size); }
+	};
+}
+
+// Adapter that lets a fixed_menu type be used wherever a runtime Beverages* is expected.
+// A fixed menu item is priced at compile time, so it keeps the compiled-in prices.
+template<class Item>
+class FixedBeverage : public Beverages
+{
+public:
+	FixedBeverage(Size size = Size::TALL)
+	{
+		size_ = size;
+	}
+	void appendDescription(std::string& out)
+	{
+		out += Item::description.view();
+	}
+	std::size_t descriptionLength()
+	{
+		return Item::description.view().size();
+	}
+protected:
+	double computeCost(const PricingTable&)
+	{
+		return Item::cost(size_);
+	}
+};
+
+#if defined(DECORATOR_BENCHMARKS)
+// Compares pricing the same recipe through the runtime decorator chain and through the fixed_menu type.
+// The size changes on every iteration so the runtime chain cannot answer from its cost cache.
+void benchmarkFixedMenu(long iterations = 10000000)
+{
+	using Clock = std::chrono::steady_clock;
+	using MochaMilk = fixed_menu::Mocha<fixed_menu::SteamedMilk<fixed_menu::HouseBlend>>;
+	const Beverages::Size sizes[] = { Beverages::Size::TALL, Beverages::Size::GRANDE, Beverages::Size::VENTI };
+
+	OrderArena order;
+	Beverages* chain = order.make<Mocha>(order.make<SteamedMilk>(order.make<HouseBlend>()));
+	double runtime_total = 0.0;
+	auto start = Clock::now();
+	for (long i = 0; i < iterations; ++i)
 	{
-		return beverages_->cost() + 0.56;
+		chain->SetSize(sizes[i % 3]);
+		runtime_total += chain->cost();
 	}
+	std::chrono::duration<double, std::milli> runtime_ms = Clock::now() - start;
+
+	double fixed_total = 0.0;
+	start = Clock::now();
+	for (long i = 0; i < iterations; ++i)
+		fixed_total += MochaMilk::cost(sizes[i % 3]);
+	std::chrono::duration<double, std::milli> fixed_ms = Clock::now() - start;
+
+	static_assert(MochaMilk::cost(Beverages::Size::TALL) > 0.0, "fixed menu prices fold to constants");
+	std::cout << MochaMilk::description.view() << ": runtime chain " << runtime_ms.count() << " ms ("
+		<< runtime_total << "), fixed menu " << fixed_ms.count() << " ms (" << fixed_total << ") for "
+		<< iterations << " orders\n";
+}
+#endif
+
+// Batch pricing for re-pricing large numbers of orders without walking a Beverages* chain per order.
+// Orders are kept in struct-of-arrays form: one byte per field per order.
+
+struct OrderBatch
+{
+	std::vector<std::uint8_t> product;
+	std::vector<std::uint8_t> size;
+	std::vector<std::uint8_t> mocha;		// number of Mocha decorators in the order
+	std::vector<std::uint8_t> steamed_milk;	// number of SteamedMilk decorators in the order
+
+	void add(Product p, Beverages::Size s, std::uint8_t mocha_count, std::uint8_t steamed_milk_count)
+	{
+		product.push_back(static_cast<std::uint8_t>(p));
+		size.push_back(static_cast<std::uint8_t>(s));
+		mocha.push_back(mocha_count);
+		steamed_milk.push_back(steamed_milk_count);
+	}
+	std::size_t count() const { return product.size(); }
 };
 
+namespace batch_pricing
+{
+	constexpr int kSizeCount = PricingTableData::kSizeCount;
+
+	// base_price is indexed by product * kSizeCount + size, the condiment rows by size
+	struct PriceRows
+	{
+		const double* base_price;
+		const double* mocha_price;
+		const double* steamed_milk_price;
+	};
+	inline PriceRows rows(const PricingTableData& data)
+	{
+		return { &data.base_price[0][0], data.condiment_price[static_cast<int>(Condiment::MOCHA)],
+			data.condiment_price[static_cast<int>(Condiment::STEAMED_MILK)] };
+	}
+
+	inline double priceOne(const PriceRows& t, std::uint8_t product, std::uint8_t size, std::uint8_t mocha, std::uint8_t steamed_milk)
+	{
+		return t.base_price[product * kSizeCount + size] + mocha * t.mocha_price[size] + steamed_milk * t.steamed_milk_price[size];
+	}
+
+#if defined(__AVX2__)
+	// Widens four consecutive bytes to four 32-bit lanes
+	inline __m128i loadBytes(const std::uint8_t* bytes)
+	{
+		std::int32_t packed;
+		std::memcpy(&packed, bytes, sizeof(packed));
+		return _mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed));
+	}
+#endif
+}
+
+// Writes the cost of every order in the batch to totals, which must hold orders.count() values.
+// Results match Beverages::cost() of the equivalent decorator chain up to floating point rounding
+// (condiments are multiplied by their count rather than added one level at a time).
+// The whole batch is priced against the PricingTable that is current when the call starts.
+void priceOrders(const OrderBatch& orders, double* totals)
+{
+	using namespace batch_pricing;
+	const PriceRows t = rows(PricingTable::current()->data());
+	const std::size_t n = orders.count();
+	const std::uint8_t* product = orders.product.data();
+	const std::uint8_t* size = orders.size.data();
+	const std::uint8_t* mocha = orders.mocha.data();
+	const std::uint8_t* steamed_milk = orders.steamed_milk.data();
+	std::size_t i = 0;
+#if defined(__AVX2__)
+	const __m128i size_count = _mm_set1_epi32(kSizeCount);
+	for (; i + 4 <= n; i += 4)
+	{
+		const __m128i s = loadBytes(size + i);
+		const __m128i base_index = _mm_add_epi32(_mm_mullo_epi32(loadBytes(product + i), size_count), s);
+		// The masked form with a zeroed source: the plain gather leaves its source operand undefined
+		const __m256d all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+		const __m256d base = _mm256_mask_i32gather_pd(_mm256_setzero_pd(), t.base_price, base_index, all, sizeof(double));
+		const __m256d mocha_price = _mm256_mask_i32gather_pd(_mm256_setzero_pd(), t.mocha_price, s, all, sizeof(double));
+		const __m256d milk_price = _mm256_mask_i32gather_pd(_mm256_setzero_pd(), t.steamed_milk_price, s, all, sizeof(double));
+		const __m256d mocha_count = _mm256_cvtepi32_pd(loadBytes(mocha + i));
+		const __m256d milk_count = _mm256_cvtepi32_pd(loadBytes(steamed_milk + i));
+		const __m256d total = _mm256_add_pd(base, _mm256_add_pd(_mm256_mul_pd(mocha_count, mocha_price), _mm256_mul_pd(milk_count, milk_price)));
+		_mm256_storeu_pd(totals + i, total);
+	}
+#elif defined(__SSE2__) || defined(_M_X64)
+	// SSE2 has no gather, so the two prices of each pair are loaded separately and the arithmetic is paired
+	for (; i + 2 <= n; i += 2)
+	{
+		const std::size_t s0 = size[i];
+		const std::size_t s1 = size[i + 1];
+		const __m128d base = _mm_set_pd(t.base_price[product[i + 1] * kSizeCount + s1], t.base_price[product[i] * kSizeCount + s0]);
+		const __m128d mocha_price = _mm_set_pd(t.mocha_price[s1], t.mocha_price[s0]);
+		const __m128d milk_price = _mm_set_pd(t.steamed_milk_price[s1], t.steamed_milk_price[s0]);
+		const __m128d mocha_count = _mm_set_pd(mocha[i + 1], mocha[i]);
+		const __m128d milk_count = _mm_set_pd(steamed_milk[i + 1], steamed_milk[i]);
+		const __m128d total = _mm_add_pd(base, _mm_add_pd(_mm_mul_pd(mocha_count, mocha_price), _mm_mul_pd(milk_count, milk_price)));
+		_mm_storeu_pd(totals + i, total);
+	}
+#endif
+	for (; i < n; ++i)
+		totals[i] = priceOne(t, product[i], size[i], mocha[i], steamed_milk[i]);
+}
+
+// Prices every combination of size and condiment counts (up to three of each) with priceOrders() and
+// with the equivalent decorator chain, and reports whether they agree
+bool checkBatchPricing()
+{
+	const Beverages::Size sizes[] = { Beverages::Size::TALL, Beverages::Size::GRANDE, Beverages::Size::VENTI };
+	OrderBatch batch;
+	for (Beverages::Size s : sizes)
+		for (std::uint8_t mocha = 0; mocha <= 3; ++mocha)
+			for (std::uint8_t milk = 0; milk <= 3; ++milk)
+				batch.add(Product::HOUSE_BLEND, s, mocha, milk);
+	std::vector<double> totals(batch.count());
+	priceOrders(batch, totals.data());
+
+	OrderArena arena;
+	std::size_t mismatches = 0;
+	for (std::size_t i = 0; i < batch.count(); ++i)
+	{
+		Beverages* order = arena.make<HouseBlend>();
+		order->SetSize(static_cast<Beverages::Size>(batch.size[i]));
+		for (std::uint8_t m = 0; m < batch.mocha[i]; ++m)
+			order = arena.make<Mocha>(order);
+		for (std::uint8_t m = 0; m < batch.steamed_milk[i]; ++m)
+			order = arena.make<SteamedMilk>(order);
+		double difference = totals[i] - order->cost();
+		if (difference > 1e-9 || difference < -1e-9)
+			++mismatches;
+		arena.release();
+	}
+	std::cout << "batch pricing: " << batch.count() - mismatches << " of " << batch.count()
+		<< " orders match Beverages::cost()\n";
+	return mismatches == 0;
+}
+
+// Two threads price and describe one shared chain while a third keeps installing two alternating tables.
+// Every price must be the chain's total under one of the tables, never a cached cost of the other.
+bool checkConcurrentPricing(int installs = 200)
+{
+	PricingTableData doubled = PricingTable::defaults();
+	for (auto& prices : doubled.base_price)
+		for (double& price : prices)
+			price *= 2;
+	for (auto& prices : doubled.condiment_price)
+		for (double& price : prices)
+			price *= 2;
+
+	OrderArena arena;
+	Beverages* order = arena.make<SteamedMilk>(arena.make<Mocha>(arena.make<HouseBlend>()));
+	PricingTable normal_table(PricingTable::defaults());
+	PricingTable doubled_table(doubled);
+	const double expected[] = { order->cost(normal_table), order->cost(doubled_table) };
+
+	std::atomic<bool> done(false);
+	std::atomic<std::size_t> prices(0), mismatches(0);
+	auto price = [&]
+	{
+		while (!done.load(std::memory_order_acquire))
+		{
+			double cost = order->cost();
+			if (cost != expected[0] && cost != expected[1])
+				mismatches.fetch_add(1, std::memory_order_relaxed);
+			if (order->getDescription() != "HouseBlend Mocha SteamedMilk")
+				mismatches.fetch_add(1, std::memory_order_relaxed);
+			prices.fetch_add(1, std::memory_order_relaxed);
+		}
+	};
+	std::thread first(price), second(price);
+	for (int i = 0; i < installs; ++i)
+	{
+		PricingTable::install(std::unique_ptr<PricingTable>(new PricingTable(i % 2 ? PricingTable::defaults() : doubled)));
+		std::this_thread::yield();
+	}
+	done.store(true, std::memory_order_release);
+	first.join();
+	second.join();
+	PricingTable::install(std::unique_ptr<PricingTable>(new PricingTable(PricingTable::defaults())));
+	// Both pricing threads have joined, so no cost() can still be reading a replaced table
+	PricingTable::reclaimRetired();
+	std::cout << "concurrent pricing: " << prices.load() - mismatches.load() << " of " << prices.load()
+		<< " prices match a whole table\n";
+	arena.release();
+	return mismatches.load() == 0;
+}
+
+// Saves a table with every price raised, loads and installs it, and checks that a chain priced (and cached)
+// under the old table re-prices under the new one. Then puts the default prices back and frees the
+// replaced tables.
+bool checkPricingReload(const std::string& path = "pricing_check.bin")
+{
+	OrderArena arena;
+	Beverages* order = arena.make<Mocha>(arena.make<HouseBlend>());
+	order->SetSize(Beverages::Size::GRANDE);
+	double before = order->cost();
+
+	PricingTableData raised = PricingTable::defaults();
+	raised.base_price[static_cast<int>(Product::HOUSE_BLEND)][static_cast<int>(Beverages::Size::GRANDE)] += 1.0;
+	raised.condiment_price[static_cast<int>(Condiment::MOCHA)][static_cast<int>(Beverages::Size::GRANDE)] += 0.5;
+	bool ok = PricingTable::save(path, raised);
+	std::unique_ptr<PricingTable> loaded = ok ? PricingTable::load(path) : nullptr;
+	ok = loaded != nullptr;
+	if (ok)
+	{
+		PricingTable::install(std::move(loaded));
+		double after = order->cost();
+		ok = after - before > 1.5 - 1e-9 && after - before < 1.5 + 1e-9;
+	}
+	PricingTable::install(std::unique_ptr<PricingTable>(new PricingTable(PricingTable::defaults())));
+	ok = ok && order->cost() == before && PricingTable::load(path + ".missing") == nullptr;
+	arena.release();
+	std::remove(path.c_str());
+	PricingTable::reclaimRetired();
+	ok = ok && PricingTable::retiredCount() == 0;
+	std::cout << "pricing reload: " << (ok ? "saved, loaded and installed table re-prices cached orders\n" : "failed\n");
+	return ok;
+}
+
+// Compact binary encoding of an order:
+//   byte 0      product id in the high 6 bits, size in the low 2 bits
+//   byte 1      number of condiments (at most 255)
+//   byte 2...   condiment ids, 2 bits each, four per byte, innermost condiment first
+// OrderView reads cost and description straight from the bytes, without rebuilding the decorator chain.
+namespace order_encoding
+{
+	constexpr std::size_t kHeaderSize = 2;
+	constexpr std::size_t kMaxCondiments = 255;
+	static_assert(static_cast<int>(Condiment::COUNT) <= 4, "condiment ids are packed into 2 bits");
+	static_assert(static_cast<int>(Product::COUNT) <= 64, "product ids are packed into 6 bits");
+
+	constexpr std::size_t encodedSize(std::size_t condiments)
+	{
+		return kHeaderSize + (condiments + 3) / 4;
+	}
+}
+
+// Appends the encoding of order to out. Returns false, leaving out unchanged, if the chain contains a
+// beverage without a product id (such as a FixedBeverage) or more than 255 condiments.
+bool encodeOrder(Beverages* order, std::vector<std::uint8_t>& out)
+{
+	using namespace order_encoding;
+	Condiment condiments[kMaxCondiments];
+	std::size_t count = 0;
+	Beverages* beverage = order;
+	// The chain is walked outside in, so condiments are collected in reverse
+	while (CondimentsDecorator* decorator = dynamic_cast<CondimentsDecorator*>(beverage))
+	{
+		if (count == kMaxCondiments)
+			return false;
+		condiments[count++] = decorator->condimentId();
+		beverage = decorator->beverages_;
+	}
+	if (beverage == nullptr || beverage->productId() == Product::COUNT)
+		return false;
+
+	std::size_t start = out.size();
+	out.resize(start + encodedSize(count), 0);
+	std::uint8_t* bytes = out.data() + start;
+	bytes[0] = static_cast<std::uint8_t>(static_cast<int>(beverage->productId()) << 2 | static_cast<int>(beverage->GetSize()));
+	bytes[1] = static_cast<std::uint8_t>(count);
+	for (std::size_t i = 0; i < count; ++i)
+		bytes[kHeaderSize + i / 4] |= static_cast<std::uint8_t>(static_cast<int>(condiments[count - 1 - i]) << (i % 4 * 2));
+	return true;
+}
+
+// A zero-copy reader over one encoded order. The bytes must outlive the view.
+class OrderView
+{
+public:
+	// size is the number of bytes available; valid() is false if they do not start with a complete order
+	OrderView(const std::uint8_t* data, std::size_t size) : data_(data)
+	{
+		using namespace order_encoding;
+		valid_ = size >= kHeaderSize && size >= order_encoding::encodedSize(data[1])
+			&& (data[0] >> 2) < static_cast<int>(Product::COUNT) && (data[0] & 3) < PricingTableData::kSizeCount;
+		for (std::size_t i = 0; valid_ && i < condimentCount(); ++i)
+			valid_ = static_cast<int>(condiment(i)) < static_cast<int>(Condiment::COUNT);
+	}
+	bool valid() const { return valid_; }
+	// Bytes taken by this order, i.e. the offset of the next order in a stream
+	std::size_t encodedSize() const { return order_encoding::encodedSize(condimentCount()); }
+	Product product() const { return static_cast<Product>(data_[0] >> 2); }
+	Beverages::Size size() const { return static_cast<Beverages::Size>(data_[0] & 3); }
+	std::size_t condimentCount() const { return data_[1]; }
+	// Condiments are numbered from the innermost one
+	Condiment condiment(std::size_t i) const
+	{
+		return static_cast<Condiment>(data_[order_encoding::kHeaderSize + i / 4] >> (i % 4 * 2) & 3);
+	}
+
+	// Adds the prices in the same order as the decorator chain, so the result equals its cost()
+	double cost(const PricingTable& prices) const
+	{
+		double total = prices.basePrice(product(), size());
+		for (std::size_t i = 0; i < condimentCount(); ++i)
+			total += prices.condimentPrice(condiment(i), size());
+		return total;
+	}
+	double cost() const
+	{
+		return cost(*PricingTable::current());
+	}
+	void appendDescription(std::string& out) const
+	{
+		out += kProductNames[static_cast<int>(product())];
+		for (std::size_t i = 0; i < condimentCount(); ++i)
+			out += kCondimentNames[static_cast<int>(condiment(i))];
+	}
+	std::size_t descriptionLength() const
+	{
+		std::size_t length = kProductNames[static_cast<int>(product())].size();
+		for (std::size_t i = 0; i < condimentCount(); ++i)
+			length += kCondimentNames[static_cast<int>(condiment(i))].size();
+		return length;
+	}
+
+	// Rebuilds the decorator chain in arena, for callers that need a real Beverages*
+	Beverages* materialize(OrderArena& arena) const
+	{
+		Beverages* beverage = nullptr;
+		switch (product())
+		{
+		case Product::HOUSE_BLEND:
+			beverage = arena.make<HouseBlend>();
+			break;
+		default:
+			return nullptr;
+		}
+		beverage->SetSize(size());
+		for (std::size_t i = 0; i < condimentCount(); ++i)
+		{
+			switch (condiment(i))
+			{
+			case Condiment::MOCHA:
+				beverage = arena.make<Mocha>(beverage);
+				break;
+			case Condiment::STEAMED_MILK:
+				beverage = arena.make<SteamedMilk>(beverage);
+				break;
+			default:
+				return nullptr;
+			}
+		}
+		return beverage;
+	}
+
+private:
+	const std::uint8_t* data_;
+	bool valid_ = false;
+};
+
+// The benchmarks are built only with DECORATOR_BENCHMARKS defined, because they replace the program's
+// global allocation functions to count the allocations made per order.
+#if defined(DECORATOR_BENCHMARKS)
+#include "CountingAllocator.h"
+
+// Builds, prices and frees the same four-level order with plain new/delete and with one reused OrderArena
+void benchmarkOrderArena(long orders = 1000000)
+{
+	using Clock = std::chrono::steady_clock;
+	double heap_total = 0.0;
+	std::size_t allocations = t_allocation_count;
+	auto start = Clock::now();
+	for (long i = 0; i < orders; ++i)
+	{
+		Beverages* house_blend = new HouseBlend();
+		Beverages* mocha = new Mocha(house_blend);
+		Beverages* milk = new SteamedMilk(mocha);
+		Beverages* order = new Mocha(milk);
+		heap_total += order->cost();
+		delete order;
+		delete milk;
+		delete mocha;
+		delete house_blend;
+	}
+	std::chrono::duration<double, std::milli> heap_ms = Clock::now() - start;
+	std::size_t heap_allocations = t_allocation_count - allocations;
+
+	double arena_total = 0.0;
+	OrderArena arena;
+	allocations = t_allocation_count;
+	start = Clock::now();
+	for (long i = 0; i < orders; ++i)
+	{
+		Beverages* order = arena.make<Mocha>(arena.make<SteamedMilk>(arena.make<Mocha>(arena.make<HouseBlend>())));
+		arena_total += order->cost();
+		arena.release();
+	}
+	std::chrono::duration<double, std::milli> arena_ms = Clock::now() - start;
+	std::size_t arena_allocations = t_allocation_count - allocations;
+
+	std::cout << "new/delete: " << heap_ms.count() << " ms, " << static_cast<double>(heap_allocations) / orders
+		<< " allocations per order (" << heap_total << ")\n";
+	std::cout << "OrderArena: " << arena_ms.count() << " ms, " << static_cast<double>(arena_allocations) / orders
+		<< " allocations per order (" << arena_total << ")\n";
+}
+#endif
+
 int main()
 {
-	Beverages* houseblend = new HouseBlend();
+	OrderArena order;
+	Beverages* houseblend = order.make<HouseBlend>();
 	std::cout << houseblend->getDescription() << " " << houseblend->cost() << "$" << "\n";
 	houseblend->SetSize(Beverages::Size::GRANDE);
-	houseblend = new Mocha(houseblend);
+	houseblend = order.make<Mocha>(houseblend);
 	std::cout << houseblend->getDescription() << " " << houseblend->cost() << "$" << "\n";
-	houseblend = new SteamedMilk(houseblend);
+	houseblend = order.make<SteamedMilk>(houseblend);
 	std::cout << houseblend->getDescription() << " " << houseblend->cost() << "$" << "\n";
-	houseblend = new Mocha(houseblend);
+	houseblend = order.make<Mocha>(houseblend);
 	std::cout << houseblend->getDescription() << " " << houseblend->cost() << "$" << "\n";
 
+	Beverages* menu_item = order.make<FixedBeverage<fixed_menu::Mocha<fixed_menu::HouseBlend>>>(Beverages::Size::GRANDE);
+	std::cout << menu_item->getDescription() << " " << menu_item->cost() << "$" << "\n";
+
+	std::vector<std::uint8_t> encoded;
+	encodeOrder(houseblend, encoded);
+	OrderView view(encoded.data(), encoded.size());
+	std::string description;
+	view.appendDescription(description);
+	std::cout << description << " " << view.cost() << "$ from " << encoded.size() << " encoded bytes\n";
+	order.release();
+	checkBatchPricing();
+	checkPricingReload();
+	checkConcurrentPricing();
+
+#if defined(DECORATOR_BENCHMARKS)
+	benchmarkFixedMenu();
+	benchmarkOrderArena();
+#endif
 }
\ No newline at end of file
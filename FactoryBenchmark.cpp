@@ -0,0 +1,191 @@
+// Measures what one order costs in each of the three factory variants:
+// FactoryPattern.cpp (Simple Factory), FactoryMethodPattern.cpp (Factory Method) and
+// AbstractFactoryPattern.cpp (Abstract Factory). Each variant's PizzaStore::orderPizza is driven from a
+// configurable number of threads, and the benchmark reports orders per second, p50/p99 latency per order,
+// and heap allocations and bytes per order.
+// std::cout is pointed at a null sink while the orders run, so the numbers reflect the factory itself
+// rather than the console.
+
+// Every standard header the pattern files use is included here first, so their own #includes are no-ops
+// inside the namespaces below and each file only contributes its own classes. ProductRegistry.h is
+// included here too, so its templates stay global and are shared by the three variants.
+#include<iostream>
+#include<string>
+#include<string_view>
+#include<algorithm>
+#include<array>
+#include<atomic>
+#include<chrono>
+#include<condition_variable>
+#include<cstddef>
+#include<cstdint>
+#include<cstdlib>
+#include<memory>
+#include<mutex>
+#include<new>
+#include<streambuf>
+#include<thread>
+#include<vector>
+#include "ProductRegistry.h"
+
+namespace simple_factory
+{
+#include "FactoryPattern.cpp"
+}
+namespace factory_method
+{
+#include "FactoryMethodPattern.cpp"
+}
+namespace abstract_factory
+{
+#include "AbstractFactoryPattern.cpp"
+}
+
+// Counts allocations per order. The factories allocate with new(std::nothrow), and orderPizzas with
+// aligned new, so the nothrow and aligned forms matter here.
+#include "CountingAllocator.h"
+
+// Discards everything written to it. It keeps no state of its own, so threads can share it.
+class NullBuffer : public std::streambuf
+{
+protected:
+	int_type overflow(int_type c) override { return traits_type::not_eof(c); }
+	std::streamsize xsputn(const char*, std::streamsize count) override { return count; }
+};
+
+struct BenchmarkResult
+{
+	std::size_t orders = 0;
+	double seconds = 0.0;
+	std::uint64_t p50_ns = 0;
+	std::uint64_t p99_ns = 0;
+	std::size_t allocations = 0;
+	std::size_t bytes = 0;
+};
+
+// Runs orders_per_thread orders on each of threads threads. make_order() is called once per thread and
+// returns the callable that places one order, so every thread has its own store.
+template<class MakeOrder>
+BenchmarkResult runOrders(unsigned threads, std::size_t orders_per_thread, MakeOrder make_order)
+{
+	using Clock = std::chrono::steady_clock;
+	static constexpr std::size_t kWarmupOrders = 1000;
+
+	std::vector<std::vector<std::uint64_t>> latencies(threads);
+	std::vector<std::size_t> allocations(threads, 0);
+	std::vector<std::size_t> bytes(threads, 0);
+	std::atomic<unsigned> ready(0);
+	std::atomic<bool> go(false);
+	std::vector<std::thread> workers;
+	for (unsigned t = 0; t < threads; ++t)
+	{
+		workers.emplace_back([&, t]
+		{
+			auto order = make_order();
+			std::vector<std::uint64_t>& latency = latencies[t];
+			latency.resize(orders_per_thread);
+			// Fills the pools and the stores' buffers, as in a store that has been open for a while
+			for (std::size_t i = 0; i < kWarmupOrders; ++i)
+				order();
+			ready.fetch_add(1, std::memory_order_acq_rel);
+			while (!go.load(std::memory_order_acquire))
+				std::this_thread::yield();
+
+			std::size_t allocation_count = t_allocation_count;
+			std::size_t allocated_bytes = t_allocated_bytes;
+			for (std::size_t i = 0; i < orders_per_thread; ++i)
+			{
+				auto begin = Clock::now();
+				order();
+				latency[i] = static_cast<std::uint64_t>(std::chrono::nanoseconds(Clock::now() - begin).count());
+			}
+			allocations[t] = t_allocation_count - allocation_count;
+			bytes[t] = t_allocated_bytes - allocated_bytes;
+		});
+	}
+	while (ready.load(std::memory_order_acquire) != threads)
+		std::this_thread::yield();
+	auto start = Clock::now();
+	go.store(true, std::memory_order_release);
+	for (std::thread& worker : workers)
+		worker.join();
+	std::chrono::duration<double> elapsed = Clock::now() - start;
+
+	BenchmarkResult result;
+	result.orders = orders_per_thread * threads;
+	result.seconds = elapsed.count();
+	std::vector<std::uint64_t> all;
+	all.reserve(result.orders);
+	for (unsigned t = 0; t < threads; ++t)
+	{
+		all.insert(all.end(), latencies[t].begin(), latencies[t].end());
+		result.allocations += allocations[t];
+		result.bytes += bytes[t];
+	}
+	if (!all.empty())
+	{
+		std::size_t p50 = all.size() / 2;
+		std::size_t p99 = all.size() * 99 / 100;
+		std::nth_element(all.begin(), all.begin() + p50, all.end());
+		result.p50_ns = all[p50];
+		std::nth_element(all.begin(), all.begin() + p99, all.end());
+		result.p99_ns = all[p99];
+	}
+	return result;
+}
+
+void printResult(std::ostream& out, const char* name, const BenchmarkResult& result)
+{
+	double orders = result.orders ? static_cast<double>(result.orders) : 1.0;
+	out << name << ": " << (result.seconds > 0 ? result.orders / result.seconds : 0.0) << " orders/s, p50 "
+		<< result.p50_ns << " ns, p99 " << result.p99_ns << " ns, " << result.allocations / orders
+		<< " allocations/order, " << result.bytes / orders << " bytes/order\n";
+}
+
+void benchmarkFactories(unsigned threads, std::size_t orders_per_thread)
+{
+	NullBuffer null_buffer;
+	std::streambuf* console = std::cout.rdbuf(&null_buffer);
+
+	BenchmarkResult simple = runOrders(threads, orders_per_thread, []
+	{
+		static simple_factory::SimplePizzaFactory factory;
+		return [store = simple_factory::PizzaStore(&factory)]() mutable
+		{
+			simple_factory::PizzaHandle pizza = store.orderPizza("cheese");
+		};
+	});
+	BenchmarkResult method = runOrders(threads, orders_per_thread, []
+	{
+		return [store = std::make_shared<factory_method::NYPizzaStore>()]
+		{
+			factory_method::PizzaHandle pizza = store->orderPizza("cheese");
+		};
+	});
+	BenchmarkResult abstract = runOrders(threads, orders_per_thread, []
+	{
+		return [store = std::make_shared<abstract_factory::NYPizzaStore>()]
+		{
+			delete store->orderPizza("cheese");
+		};
+	});
+
+	std::cout.rdbuf(console);
+	std::cout << threads << " threads, " << orders_per_thread << " orders per thread\n";
+	printResult(std::cout, "Simple Factory  ", simple);
+	printResult(std::cout, "Factory Method  ", method);
+	printResult(std::cout, "Abstract Factory", abstract);
+}
+
+// Usage: FactoryBenchmark [threads] [orders per thread]
+int main(int argc, char* argv[])
+{
+	unsigned threads = std::thread::hardware_concurrency();
+	std::size_t orders_per_thread = 200000;
+	if (argc > 1)
+		threads = static_cast<unsigned>(std::strtoul(argv[1], nullptr, 10));
+	if (argc > 2)
+		orders_per_thread = std::strtoul(argv[2], nullptr, 10);
+	benchmarkFactories(threads ? threads : 1, orders_per_thread);
+	return 0;
+}
@@ -1,6 +1,17 @@
 #include<iostream>
 #include<string>
+#include<string_view>
+#include<array>
+#include<atomic>
+#include<chrono>
+#include<condition_variable>
+#include<cstdint>
+#include<memory>
+#include<mutex>
 #include<new>
+#include<thread>
+#include<vector>
+#include "ProductRegistry.h"
 //Factory Method Pattern defines an interface for creating an object, but lets subclasses decide which
 //class to instantiate.
 //A Factory method handles object creation and encapsulates it in a subclass.This decouples the client code
@@ -22,6 +33,7 @@
 // 3.No method should override an implemented method of any of its base classes.(If you override an
 // implemented method, then your base class wasn't really an abstraction to start with.Those methods
 // implemented in your base class are meant to be shared by all your subclasses.
+
 class Pizza
 {
 protected:
@@ -45,8 +57,55 @@ public:
 	{
 		std::cout << "Put Pizza in a box\n";
 	}
+	// Called when a pooled pizza is returned; clear() keeps the strings' buffers for the next order
+	virtual void reset()
+	{
+		name.clear();
+		sauce.clear();
+		dough.clear();
+	}
 	virtual ~Pizza() = default;
 };
+
+// Pizzas come from ProductPool and go back to it through the handle's deleter
+using PizzaHandle = PooledHandle<Pizza>;
+template<class T>
+using PizzaPool = ProductPool<Pizza, T>;
+
+// What a store's registry knows about one concrete pizza: how to take a fresh one from its pool, and how
+// to copy a prototype into one
+struct PizzaType
+{
+	PizzaHandle (*acquire)();
+	PizzaHandle (*clone)(const Pizza& prototype);
+};
+
+template<class Concrete>
+const PizzaType* pizzaType()
+{
+	static const PizzaType type = { &PizzaPool<Concrete>::acquire, &PizzaPool<Concrete>::clone };
+	return &type;
+}
+
+// Each regional store has its own registry, and pizzas register themselves with a PizzaRegistrar, so
+// adding a pizza does not touch the store's createPizza()
+using PizzaRegistry = ProductRegistry<Pizza, PizzaHandle, const PizzaType*>;
+
+// Registers Concrete under name when it is constructed, typically as a static object next to the class.
+// Registered pizzas are created through their PizzaPool. A name that is already taken, or a registry
+// that already holds kCapacity pizzas, is reported on std::cerr and leaves registered false, since the
+// pizza could otherwise never be ordered without any sign of why.
+template<class Concrete>
+struct PizzaRegistrar
+{
+	PizzaRegistrar(PizzaRegistry& registry, std::string_view name)
+		: registered(registry.add(name, pizzaType<Concrete>()))
+	{
+		if (!registered)
+			std::cerr << "could not register pizza \"" << name << "\"\n";
+	}
+	const bool registered;
+};
 class NYStyleCheesePizza : public Pizza
 {
 	void prepare() override
@@ -82,9 +141,10 @@ class PepperoniPizza : public Pizza
 class PizzaStore
 {
 public:
-	Pizza* orderPizza(const std::string& pizza_type)
+	// The pizza goes back to its pool when the returned handle is released
+	PizzaHandle orderPizza(std::string_view pizza_type)
 	{
-		Pizza* pizza_ = nullptr;
+		PizzaHandle pizza_;
 		pizza_ = createPizza(pizza_type);
 		if (nullptr != pizza_)
 		{
@@ -96,19 +156,26 @@ public:
 
 		return pizza_;
 	}
+	// Public and virtual so a PizzaRouter can own stores of any region
+	virtual ~PizzaStore() = default;
 protected:
-	virtual Pizza* createPizza(const std::string& pizza_type) = 0;
-	~PizzaStore() = default;
+	friend class PizzaPipeline;
+	virtual PizzaHandle createPizza(std::string_view pizza_type) = 0;
 };
 
 class NYPizzaStore : public PizzaStore
 {
 public:
-	Pizza* createPizza(const std::string& pizza_type) override
+	static PizzaRegistry& products()
 	{
-		Pizza* pizza_ = nullptr;
-		if (pizza_type == "cheese")
-			pizza_ = new(std::nothrow) NYStyleCheesePizza();
+		static PizzaRegistry registry;
+		return registry;
+	}
+	PizzaHandle createPizza(std::string_view pizza_type) override
+	{
+		PizzaHandle pizza_;
+		if (const PizzaType* type = products().find(pizza_type))
+			pizza_ = type->acquire();
 		/*else if (pizza_type == "greek")
 			pizza_ = new(std::nothrow) GreekPizza();
 		else if (pizza_type == "pepperoni")
@@ -120,11 +187,16 @@ public:
 class ChicagoPizzaStore : public PizzaStore
 {
 public:
-	Pizza* createPizza(const std::string& pizza_type) override
+	static PizzaRegistry& products()
+	{
+		static PizzaRegistry registry;
+		return registry;
+	}
+	PizzaHandle createPizza(std::string_view pizza_type) override
 	{
-		Pizza* pizza_ = nullptr;
-		if (pizza_type == "cheese")
-			pizza_ = new(std::nothrow) ChicagoStyleCheesePizza();
+		PizzaHandle pizza_;
+		if (const PizzaType* type = products().find(pizza_type))
+			pizza_ = type->acquire();
 		/*else if (pizza_type == "greek")
 			pizza_ = new(std::nothrow) GreekPizza();
 		else if (pizza_type == "pepperoni")
@@ -133,6 +205,683 @@ public:
 	}
 };
 
+static PizzaRegistrar<NYStyleCheesePizza> ny_cheese_registrar(NYPizzaStore::products(), "cheese");
+static PizzaRegistrar<ChicagoStyleCheesePizza> chicago_cheese_registrar(ChicagoPizzaStore::products(), "cheese");
+
+// Holds one prepared pizza per product of a region and makes new orders by copying it into a pooled pizza,
+// so the setup prepare() repeats for every order (assigning the same name, dough and sauce) runs once per
+// product. The prototypes are only read after add(), so clone() may be called from any thread.
+class PrototypeRegistry
+{
+public:
+	PrototypeRegistry() = default;
+	PrototypeRegistry(const PrototypeRegistry&) = delete;
+	PrototypeRegistry& operator=(const PrototypeRegistry&) = delete;
+
+	// Creates and prepares the prototype of pizza_type from a region's products. Returns false if the
+	// region has no such product or it already has a prototype.
+	bool add(const PizzaRegistry& products, std::string_view pizza_type)
+	{
+		const PizzaType* type = products.find(pizza_type);
+		if (type == nullptr || count_ == PizzaRegistry::kCapacity || prototypes_.find(pizza_type) != nullptr)
+			return false;
+		Prototype& prototype = entries_[count_];
+		prototype.type = type;
+		prototype.pizza = type->acquire();
+		if (prototype.pizza == nullptr)
+			return false;
+		prototype.pizza->prepare();
+		if (!prototypes_.add(pizza_type, &prototype))
+		{
+			prototype.pizza.reset();
+			return false;
+		}
+		++count_;
+		return true;
+	}
+	// A prepared copy of the prototype; an empty handle if there is none for pizza_type
+	PizzaHandle clone(std::string_view pizza_type) const
+	{
+		const Prototype* prototype = prototypes_.find(pizza_type);
+		if (prototype == nullptr)
+			return PizzaHandle();
+		return prototype->type->clone(*prototype->pizza);
+	}
+	// Same steps as PizzaStore::orderPizza, with prepare() replaced by the copy
+	PizzaHandle orderPizza(std::string_view pizza_type) const
+	{
+		PizzaHandle pizza_ = clone(pizza_type);
+		if (nullptr != pizza_)
+		{
+			pizza_->bake();
+			pizza_->cut();
+			pizza_->box();
+		}
+		return pizza_;
+	}
+
+private:
+	struct Prototype
+	{
+		const PizzaType* type = nullptr;
+		PizzaHandle pizza;
+	};
+
+	Prototype entries_[PizzaRegistry::kCapacity];
+	std::size_t count_ = 0;
+	ProductRegistry<Prototype, PizzaHandle, const Prototype*> prototypes_;
+};
+
+// Compares creating and preparing a pizza with cloning its prototype, with std::cout silenced so the
+// prints in prepare() do not dominate
+void benchmarkPrototypes(std::size_t orders = 1000000)
+{
+	NYPizzaStore store;
+	PrototypeRegistry prototypes;
+	prototypes.add(NYPizzaStore::products(), "cheese");
+
+	std::streambuf* console = std::cout.rdbuf(nullptr);
+	auto begin = std::chrono::steady_clock::now();
+	for (std::size_t i = 0; i < orders; ++i)
+	{
+		PizzaHandle pizza = store.createPizza("cheese");
+		pizza->prepare();
+	}
+	auto created = std::chrono::steady_clock::now();
+	for (std::size_t i = 0; i < orders; ++i)
+	{
+		PizzaHandle pizza = prototypes.clone("cheese");
+	}
+	auto cloned = std::chrono::steady_clock::now();
+	std::cout.rdbuf(console);
+
+	std::chrono::duration<double, std::nano> create_time = created - begin;
+	std::chrono::duration<double, std::nano> clone_time = cloned - created;
+	std::cout << "createPizza + prepare: " << create_time.count() / orders << " ns/pizza\n";
+	std::cout << "prototype clone:       " << clone_time.count() / orders << " ns/pizza\n";
+}
+
+
+// Bounded multi-producer/multi-consumer queue (Dmitry Vyukov's algorithm). Each cell carries a sequence
+// number that tells producers and consumers whether it is free or full for their lap around the ring,
+// so push and pop are a CAS on a position plus a release store, with no locks.
+// A consumer that has found the queue empty kSpinsBeforePark times in a row can park() instead of
+// spinning on, so idle worker threads sleep. tryPush() wakes a parked consumer; while nobody is parked it
+// costs one fence and one relaxed load, and never touches the mutex.
+template<class T>
+class BoundedQueue
+{
+public:
+	static constexpr int kSpinsBeforePark = 64;
+
+	// capacity is rounded up to a power of two
+	explicit BoundedQueue(std::size_t capacity)
+	{
+		std::size_t size = 2;
+		while (size < capacity)
+			size *= 2;
+		mask_ = size - 1;
+		cells_.reset(new Cell[size]);
+		for (std::size_t i = 0; i < size; ++i)
+			cells_[i].sequence.store(i, std::memory_order_relaxed);
+	}
+	// Moves value into the queue; returns false, leaving value alone, if the queue is full
+	bool tryPush(T& value)
+	{
+		std::size_t position = enqueue_position_.load(std::memory_order_relaxed);
+		while (true)
+		{
+			Cell& cell = cells_[position & mask_];
+			std::size_t sequence = cell.sequence.load(std::memory_order_acquire);
+			std::intptr_t difference = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(position);
+			if (difference == 0)
+			{
+				if (enqueue_position_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				{
+					cell.value = std::move(value);
+					cell.sequence.store(position + 1, std::memory_order_release);
+					wakeOne();
+					return true;
+				}
+			}
+			else if (difference < 0)
+				return false;
+			else
+				position = enqueue_position_.load(std::memory_order_relaxed);
+		}
+	}
+	bool tryPop(T& value)
+	{
+		std::size_t position = dequeue_position_.load(std::memory_order_relaxed);
+		while (true)
+		{
+			Cell& cell = cells_[position & mask_];
+			std::size_t sequence = cell.sequence.load(std::memory_order_acquire);
+			std::intptr_t difference = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(position + 1);
+			if (difference == 0)
+			{
+				if (dequeue_position_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				{
+					value = std::move(cell.value);
+					cell.sequence.store(position + mask_ + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (difference < 0)
+				return false;
+			else
+				position = dequeue_position_.load(std::memory_order_relaxed);
+		}
+	}
+	// Whether the next pop would find nothing; only a hint while other threads push and pop
+	bool empty() const
+	{
+		std::size_t position = dequeue_position_.load(std::memory_order_relaxed);
+		return cells_[position & mask_].sequence.load(std::memory_order_acquire) != position + 1;
+	}
+	// Sleeps until an item is pushed or unparkAll() is called, unless the queue already has an item or stop
+	// is set. The consumer announces itself before it checks, so a push cannot slip in between unnoticed.
+	void park(const std::atomic<bool>& stop)
+	{
+		std::unique_lock<std::mutex> lock(park_mutex_);
+		parked_.fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (empty() && !stop.load(std::memory_order_acquire))
+			wakeup_.wait(lock);
+		parked_.fetch_sub(1, std::memory_order_relaxed);
+	}
+	// Wakes every parked consumer, e.g. after setting the stop flag they check
+	void unparkAll()
+	{
+		{
+			std::lock_guard<std::mutex> lock(park_mutex_);
+		}
+		wakeup_.notify_all();
+	}
+
+private:
+	struct Cell
+	{
+		std::atomic<std::size_t> sequence;
+		T value;
+	};
+
+	// Pairs with the fence in park(): either the parking consumer sees the new item, or this sees it parked.
+	// Taking the mutex means the consumer is either not yet checking or already waiting.
+	void wakeOne()
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (parked_.load(std::memory_order_relaxed) == 0)
+			return;
+		{
+			std::lock_guard<std::mutex> lock(park_mutex_);
+		}
+		wakeup_.notify_one();
+	}
+
+	std::unique_ptr<Cell[]> cells_;
+	std::size_t mask_ = 0;
+	alignas(64) std::atomic<std::size_t> enqueue_position_{ 0 };
+	alignas(64) std::atomic<std::size_t> dequeue_position_{ 0 };
+	alignas(64) std::atomic<unsigned> parked_{ 0 };
+	std::mutex park_mutex_;
+	std::condition_variable wakeup_;
+};
+
+// Runs orderPizza()'s four steps as a pipeline: prepare, bake, cut and box each have their own worker
+// threads, connected by bounded lock-free queues, so up to four stages' worth of orders are in flight at
+// once. Per-stage utilization (busy time over the workers' wall time) shows which stage is the bottleneck.
+// submit() blocks (spinning) while the first queue is full, which throttles producers to the pipeline.
+// A worker whose input stays empty parks on its queue, so an idle pipeline uses no CPU.
+class PizzaPipeline
+{
+public:
+	static constexpr std::size_t kStages = 4;
+
+	struct StageStats
+	{
+		const char* name;
+		std::uint64_t processed;
+		double utilization;
+	};
+
+	PizzaPipeline(PizzaStore& store, std::array<unsigned, kStages> workers = { 1, 1, 1, 1 }, std::size_t queue_capacity = 1024)
+		: store_(store), start_(std::chrono::steady_clock::now())
+	{
+		for (std::size_t stage = 0; stage <= kStages; ++stage)
+			queues_[stage].reset(new BoundedQueue<Order>(queue_capacity));
+		for (std::size_t stage = 0; stage < kStages; ++stage)
+		{
+			stages_[stage].workers = workers[stage] ? workers[stage] : 1;
+			for (unsigned w = 0; w < stages_[stage].workers; ++w)
+				threads_.emplace_back([this, stage] { work(stage); });
+		}
+	}
+	PizzaPipeline(const PizzaPipeline&) = delete;
+	PizzaPipeline& operator=(const PizzaPipeline&) = delete;
+	~PizzaPipeline()
+	{
+		stop_.store(true, std::memory_order_release);
+		for (std::size_t stage = 0; stage < kStages; ++stage)
+			queues_[stage]->unparkAll();
+		for (std::thread& t : threads_)
+			t.join();
+	}
+
+	// Returns the order id, or 0 if the store does not make pizza_type
+	std::uint64_t submit(std::string_view pizza_type)
+	{
+		Order order{ 0, store_.createPizza(pizza_type) };
+		if (order.pizza == nullptr)
+			return 0;
+		order.id = next_id_.fetch_add(1, std::memory_order_relaxed);
+		while (!queues_[0]->tryPush(order))
+			std::this_thread::yield();
+		return order.id;
+	}
+	// Takes one boxed pizza if any is ready; returns an empty handle otherwise
+	PizzaHandle takeFinished(std::uint64_t* id = nullptr)
+	{
+		Order order;
+		if (!queues_[kStages]->tryPop(order))
+			return PizzaHandle();
+		if (id)
+			*id = order.id;
+		return std::move(order.pizza);
+	}
+
+	std::array<StageStats, kStages> stats() const
+	{
+		static const char* const names[kStages] = { "prepare", "bake", "cut", "box" };
+		std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start_;
+		std::array<StageStats, kStages> result;
+		for (std::size_t stage = 0; stage < kStages; ++stage)
+		{
+			double capacity_ns = static_cast<double>(elapsed.count()) * stages_[stage].workers;
+			result[stage] = { names[stage], stages_[stage].processed.load(std::memory_order_relaxed),
+				capacity_ns > 0 ? stages_[stage].busy_ns.load(std::memory_order_relaxed) / capacity_ns : 0.0 };
+		}
+		return result;
+	}
+	void printStats(std::ostream& out) const
+	{
+		for (const StageStats& stage : stats())
+			out << stage.name << ": " << stage.processed << " pizzas, " << stage.utilization * 100.0 << "% busy\n";
+	}
+
+private:
+	struct Order
+	{
+		std::uint64_t id = 0;
+		PizzaHandle pizza;
+	};
+	struct alignas(64) Stage
+	{
+		unsigned workers = 1;
+		std::atomic<std::uint64_t> processed{ 0 };
+		std::atomic<std::uint64_t> busy_ns{ 0 };
+	};
+
+	void work(std::size_t stage)
+	{
+		static void (Pizza::* const steps[kStages])() = { &Pizza::prepare, &Pizza::bake, &Pizza::cut, &Pizza::box };
+		BoundedQueue<Order>& input = *queues_[stage];
+		BoundedQueue<Order>& output = *queues_[stage + 1];
+		Order order;
+		int idle = 0;
+		while (!stop_.load(std::memory_order_acquire))
+		{
+			if (!input.tryPop(order))
+			{
+				if (++idle < BoundedQueue<Order>::kSpinsBeforePark)
+					std::this_thread::yield();
+				else
+				{
+					input.park(stop_);
+					idle = 0;
+				}
+				continue;
+			}
+			idle = 0;
+			auto begin = std::chrono::steady_clock::now();
+			((*order.pizza).*steps[stage])();
+			std::chrono::nanoseconds busy = std::chrono::steady_clock::now() - begin;
+			stages_[stage].busy_ns.fetch_add(static_cast<std::uint64_t>(busy.count()), std::memory_order_relaxed);
+			stages_[stage].processed.fetch_add(1, std::memory_order_relaxed);
+			while (!output.tryPush(order))
+			{
+				if (stop_.load(std::memory_order_acquire))
+					return;
+				std::this_thread::yield();
+			}
+		}
+	}
+
+	PizzaStore& store_;
+	std::chrono::steady_clock::time_point start_;
+	std::unique_ptr<BoundedQueue<Order>> queues_[kStages + 1];  // queues_[kStages] holds finished pizzas
+	Stage stages_[kStages];
+	std::vector<std::thread> threads_;
+	std::atomic<std::uint64_t> next_id_{ 1 };
+	std::atomic<bool> stop_{ false };
+};
+
+// Runs many regional stores in one process. Each shard is a worker thread that owns some of the stores
+// outright: only that thread ever touches them, so stores share no mutable state and need no locks.
+// Orders are routed by region into the owning shard's lock-free inbox; finished pizzas come back through
+// takeFinished(). rebalance() moves a whole store from the busiest shard to the idlest one. The old owner
+// hands the store over in an adopt message, and orders that were already on their way to it are forwarded,
+// so nothing is lost or processed twice.
+// A shard never blocks on another shard's full inbox, or on a full finished queue: messages it cannot
+// deliver wait in a local list with no size limit. That keeps shards from deadlocking on each other, but it
+// means backpressure stops at the inboxes. A caller that submits faster than it calls takeFinished() is
+// throttled only by the inboxes filling up, while finished pizzas pile up in the shards' lists, so callers
+// should keep draining takeFinished().
+// A shard with nothing in its inbox and nothing left to deliver parks on its inbox, so an idle router (one
+// shard per hardware thread by default) uses no CPU; submit() and messages from other shards wake it.
+class PizzaRouter
+{
+public:
+	static constexpr std::size_t kMaxRegions = 64;
+	static constexpr std::size_t kNoRegion = static_cast<std::size_t>(-1);
+
+	explicit PizzaRouter(std::size_t shards = std::thread::hardware_concurrency(), std::size_t queue_capacity = 1024)
+		: shard_count_(shards ? shards : 1), shards_(new Shard[shard_count_]), finished_(queue_capacity)
+	{
+		for (std::size_t i = 0; i < shard_count_; ++i)
+			shards_[i].inbox.reset(new BoundedQueue<Message>(queue_capacity));
+		for (std::size_t i = 0; i < shard_count_; ++i)
+			shards_[i].thread = std::thread([this, i] { work(i); });
+	}
+	PizzaRouter(const PizzaRouter&) = delete;
+	PizzaRouter& operator=(const PizzaRouter&) = delete;
+	~PizzaRouter()
+	{
+		stop_.store(true, std::memory_order_release);
+		for (std::size_t i = 0; i < shard_count_; ++i)
+			shards_[i].inbox->unparkAll();
+		for (std::size_t i = 0; i < shard_count_; ++i)
+			shards_[i].thread.join();
+	}
+
+	// Hands store to a shard (round robin) and returns the region id, or kNoRegion if the router is full.
+	// name must outlive the router. Not safe to call from several threads at once.
+	std::size_t addRegion(std::string_view name, std::unique_ptr<PizzaStore> store)
+	{
+		std::size_t region = region_count_.load(std::memory_order_relaxed);
+		if (region == kMaxRegions || store == nullptr)
+			return kNoRegion;
+		std::size_t shard = region % shard_count_;
+		regions_[region].name = name;
+		regions_[region].owner.store(shard, std::memory_order_relaxed);
+		Message adopt;
+		adopt.kind = Message::ADOPT;
+		adopt.region = region;
+		adopt.store = std::move(store);
+		push(*shards_[shard].inbox, adopt);
+		region_count_.store(region + 1, std::memory_order_release);
+		return region;
+	}
+	std::size_t findRegion(std::string_view name) const
+	{
+		std::size_t count = region_count_.load(std::memory_order_acquire);
+		for (std::size_t region = 0; region < count; ++region)
+			if (regions_[region].name == name)
+				return region;
+		return kNoRegion;
+	}
+
+	// Returns the order id, or 0 if region is not a registered region. pizza_type must stay valid until
+	// the order is finished (a string literal).
+	std::uint64_t submit(std::size_t region, std::string_view pizza_type)
+	{
+		if (!isRegion(region))
+			return 0;
+		Message order;
+		order.kind = Message::ORDER;
+		order.region = region;
+		order.id = next_id_.fetch_add(1, std::memory_order_relaxed);
+		order.pizza_type = pizza_type;
+		push(*shards_[owner(region)].inbox, order);
+		return order.id;
+	}
+	// Returns false if no order is finished yet. pizza is left empty if the region does not make that type.
+	bool takeFinished(std::uint64_t& id, PizzaHandle& pizza)
+	{
+		Message message;
+		if (!finished_.tryPop(message))
+			return false;
+		id = message.id;
+		pizza = std::move(message.pizza);
+		return true;
+	}
+
+	// Moves region's store to shard. Takes effect once the current owner reaches the request in its inbox.
+	// Returns false if region or shard does not exist.
+	bool migrate(std::size_t region, std::size_t shard)
+	{
+		if (!isRegion(region) || shard >= shard_count_)
+			return false;
+		Message request;
+		request.kind = Message::MIGRATE;
+		request.region = region;
+		request.shard = shard;
+		push(*shards_[owner(region)].inbox, request);
+		return true;
+	}
+	// Looks at the orders each region took since the last call and, if it helps, moves the busiest shard's
+	// hottest region that is smaller than the load gap to the idlest shard. Returns whether a store moved.
+	// Call it periodically from one control thread.
+	bool rebalance()
+	{
+		std::size_t count = region_count_.load(std::memory_order_acquire);
+		std::vector<std::uint64_t> shard_load(shard_count_, 0);
+		std::vector<std::uint64_t> recent(count);
+		for (std::size_t region = 0; region < count; ++region)
+		{
+			std::uint64_t orders = regions_[region].orders.load(std::memory_order_relaxed);
+			recent[region] = orders - regions_[region].last_orders;
+			regions_[region].last_orders = orders;
+			shard_load[owner(region)] += recent[region];
+		}
+		std::size_t busiest = 0;
+		std::size_t idlest = 0;
+		for (std::size_t shard = 1; shard < shard_count_; ++shard)
+		{
+			if (shard_load[shard] > shard_load[busiest])
+				busiest = shard;
+			if (shard_load[shard] < shard_load[idlest])
+				idlest = shard;
+		}
+		// Moving a region with load x lowers the maximum only if x is below the gap
+		std::uint64_t gap = shard_load[busiest] - shard_load[idlest];
+		std::size_t candidate = kNoRegion;
+		for (std::size_t region = 0; region < count; ++region)
+		{
+			if (owner(region) != busiest || recent[region] == 0 || recent[region] >= gap)
+				continue;
+			if (candidate == kNoRegion || recent[region] > recent[candidate])
+				candidate = region;
+		}
+		if (candidate == kNoRegion)
+			return false;
+		migrate(candidate, idlest);
+		return true;
+	}
+
+	// The shard that owns region, or kNoRegion if region does not exist
+	std::size_t ownerOf(std::size_t region) const
+	{
+		return isRegion(region) ? owner(region) : kNoRegion;
+	}
+	std::uint64_t ordersOf(std::size_t region) const
+	{
+		return isRegion(region) ? regions_[region].orders.load(std::memory_order_relaxed) : 0;
+	}
+	std::size_t shards() const { return shard_count_; }
+
+private:
+	struct Message
+	{
+		enum Kind : std::uint8_t { ORDER, ADOPT, MIGRATE, FINISHED };
+		Kind kind = ORDER;
+		std::size_t region = 0;
+		std::size_t shard = 0;  // MIGRATE: where the store goes
+		std::uint64_t id = 0;
+		std::string_view pizza_type;
+		PizzaHandle pizza;
+		std::unique_ptr<PizzaStore> store;  // ADOPT
+	};
+	struct Undelivered
+	{
+		BoundedQueue<Message>* queue;
+		Message message;
+	};
+	// Everything but the inbox is private to the shard's thread
+	struct alignas(64) Shard
+	{
+		std::unique_ptr<BoundedQueue<Message>> inbox;
+		std::unique_ptr<PizzaStore> stores[kMaxRegions];
+		std::vector<Undelivered> undelivered;
+		std::vector<Message> waiting;  // for stores this shard owns whose adopt message is still on its way
+		std::thread thread;
+	};
+	// owner changes only after the store's adopt message is queued at the new shard, so an order routed
+	// by the new owner always finds the store there or right ahead of it in the inbox
+	struct alignas(64) Region
+	{
+		std::string_view name;
+		std::atomic<std::size_t> owner{ 0 };
+		std::atomic<std::uint64_t> orders{ 0 };  // written only by the owning shard
+		std::uint64_t last_orders = 0;  // rebalance() only
+	};
+
+	bool isRegion(std::size_t region) const
+	{
+		return region < region_count_.load(std::memory_order_acquire);
+	}
+	std::size_t owner(std::size_t region) const
+	{
+		return regions_[region].owner.load(std::memory_order_acquire);
+	}
+
+	// For callers outside the shards, which may wait
+	static void push(BoundedQueue<Message>& queue, Message& message)
+	{
+		while (!queue.tryPush(message))
+			std::this_thread::yield();
+	}
+	// For shards, which must not wait on each other
+	static void send(Shard& from, BoundedQueue<Message>& queue, Message& message)
+	{
+		if (!from.undelivered.empty() || !queue.tryPush(message))
+			from.undelivered.push_back({ &queue, std::move(message) });
+	}
+	// Retries in order and stops at the first failure, so messages to one queue keep their order
+	static void flush(Shard& shard)
+	{
+		std::size_t delivered = 0;
+		while (delivered < shard.undelivered.size()
+			&& shard.undelivered[delivered].queue->tryPush(shard.undelivered[delivered].message))
+			++delivered;
+		shard.undelivered.erase(shard.undelivered.begin(), shard.undelivered.begin() + delivered);
+	}
+
+	void work(std::size_t index)
+	{
+		Shard& shard = shards_[index];
+		Message message;
+		int idle = 0;
+		while (!stop_.load(std::memory_order_acquire))
+		{
+			if (!shard.undelivered.empty())
+				flush(shard);
+			if (!shard.inbox->tryPop(message))
+			{
+				// Undelivered messages are retried until their queues drain, so only a shard with none parks
+				if (!shard.undelivered.empty() || ++idle < BoundedQueue<Message>::kSpinsBeforePark)
+					std::this_thread::yield();
+				else
+				{
+					shard.inbox->park(stop_);
+					idle = 0;
+				}
+				continue;
+			}
+			idle = 0;
+			handle(index, message);
+		}
+	}
+	void handle(std::size_t index, Message& message)
+	{
+		Shard& shard = shards_[index];
+		std::unique_ptr<PizzaStore>& store = shard.stores[message.region];
+		if (message.kind == Message::ADOPT)
+		{
+			store = std::move(message.store);
+			replayWaiting(index, message.region);
+			return;
+		}
+		// The store moved away: pass the message on to its owner. If this shard is the owner the store
+		// is still on its way here, so hold the message until it arrives rather than requeue it.
+		if (store == nullptr)
+		{
+			std::size_t current = owner(message.region);
+			if (current == index)
+				shard.waiting.push_back(std::move(message));
+			else
+				send(shard, *shards_[current].inbox, message);
+			return;
+		}
+		if (message.kind == Message::MIGRATE)
+		{
+			if (message.shard == index)
+				return;
+			Message adopt;
+			adopt.kind = Message::ADOPT;
+			adopt.region = message.region;
+			adopt.store = std::move(store);
+			send(shard, *shards_[message.shard].inbox, adopt);
+			regions_[message.region].owner.store(message.shard, std::memory_order_release);
+			return;
+		}
+		message.pizza = store->orderPizza(message.pizza_type);
+		message.kind = Message::FINISHED;
+		Region& region = regions_[message.region];
+		region.orders.store(region.orders.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		send(shard, finished_, message);
+	}
+	void replayWaiting(std::size_t index, std::size_t region)
+	{
+		Shard& shard = shards_[index];
+		if (shard.waiting.empty())
+			return;
+		std::vector<Message> ready;
+		std::size_t kept = 0;
+		for (std::size_t i = 0; i < shard.waiting.size(); ++i)
+		{
+			if (shard.waiting[i].region == region)
+			{
+				ready.push_back(std::move(shard.waiting[i]));
+				continue;
+			}
+			if (kept != i)
+				shard.waiting[kept] = std::move(shard.waiting[i]);
+			++kept;
+		}
+		shard.waiting.resize(kept);
+		for (Message& message : ready)
+			handle(index, message);
+	}
+
+	std::size_t shard_count_;
+	std::unique_ptr<Shard[]> shards_;
+	Region regions_[kMaxRegions];
+	std::atomic<std::size_t> region_count_{ 0 };
+	BoundedQueue<Message> finished_;
+	std::atomic<std::uint64_t> next_id_{ 1 };
+	std::atomic<bool> stop_{ false };
+};
 
 /*int main()
 {
@@ -140,5 +889,29 @@ public:
 	ny_pizza_store->orderPizza("cheese");
 	PizzaStore* chicago_pizza_store = new ChicagoPizzaStore();
 	chicago_pizza_store->orderPizza("cheese");
+
+	PizzaPipeline pipeline(*ny_pizza_store);
+	for (int i = 0; i < 8; ++i)
+		pipeline.submit("cheese");
+	for (int finished = 0; finished < 8;)
+		if (pipeline.takeFinished())
+			++finished;
+	pipeline.printStats(std::cout);
+
+	PizzaRouter router(2);
+	std::size_t ny = router.addRegion("ny", std::unique_ptr<PizzaStore>(new NYPizzaStore()));
+	std::size_t chicago = router.addRegion("chicago", std::unique_ptr<PizzaStore>(new ChicagoPizzaStore()));
+	for (int i = 0; i < 8; ++i)
+		router.submit(i % 2 ? ny : chicago, "cheese");
+	router.migrate(chicago, router.ownerOf(ny));
+	for (int i = 0; i < 8; ++i)
+		router.submit(i % 2 ? ny : chicago, "cheese");
+	std::uint64_t id;
+	PizzaHandle pizza;
+	for (int finished = 0; finished < 16;)
+		if (router.takeFinished(id, pizza))
+			++finished;
+
+	benchmarkPrototypes();
 	return 0;
 }*/
\ No newline at end of file
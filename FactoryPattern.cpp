@@ -1,6 +1,13 @@
 #include<iostream>
 #include<string>
+#include<string_view>
+#include<cstdint>
+#include<memory>
+#include<mutex>
 #include<new>
+#include<vector>
+#include "ProductRegistry.h"
+
 class Pizza
 {
 public:
@@ -20,8 +27,65 @@ public:
 	{
 		std::cout << "Put Pizza in a box\n";
 	}
+	// Called when a pooled pizza is returned, to bring it back to its freshly constructed state
+	virtual void reset() {}
 	virtual ~Pizza() = default;
 };
+
+// Pizzas come from ProductPool and go back to it through the handle's deleter
+using PizzaHandle = PooledHandle<Pizza>;
+template<class T>
+using PizzaPool = ProductPool<Pizza, T>;
+
+// What the registry knows about one concrete pizza: how to take one from its pool, and how to build one
+// in caller-provided storage, which PizzaStore::orderPizzas uses to construct a whole group in one block
+struct PizzaType
+{
+	PizzaHandle (*acquire)();
+	Pizza* (*constructAt)(void* storage);
+	std::size_t size;
+	std::size_t alignment;
+};
+
+template<class Concrete>
+const PizzaType* pizzaType()
+{
+	static const PizzaType type = {
+		&PizzaPool<Concrete>::acquire,
+		[](void* storage) -> Pizza* { return new(storage) Concrete(); },
+		sizeof(Concrete),
+		alignof(Concrete)
+	};
+	return &type;
+}
+
+// The pizzas SimplePizzaFactory knows; pizzas register themselves with a PizzaRegistrar, so adding one
+// does not touch the factory
+using PizzaRegistry = ProductRegistry<Pizza, PizzaHandle, const PizzaType*>;
+
+// Registers Concrete under name when it is constructed, typically as a static object next to the class.
+// Registered pizzas are created through their PizzaPool. A name that is already taken, or a registry
+// that already holds kCapacity pizzas, is reported on std::cerr and leaves registered false, since the
+// pizza could otherwise never be ordered without any sign of why.
+template<class Concrete>
+struct PizzaRegistrar
+{
+	PizzaRegistrar(PizzaRegistry& registry, std::string_view name)
+		: registered(registry.add(name, pizzaType<Concrete>()))
+	{
+		if (!registered)
+			std::cerr << "could not register pizza \"" << name << "\"\n";
+	}
+	const bool registered;
+};
+
+// The pizzas SimplePizzaFactory can create; a function-local static so registrars can run in any order
+PizzaRegistry& pizzaRegistry()
+{
+	static PizzaRegistry registry;
+	return registry;
+}
+
 class CheesePizza: public Pizza
 {
 	void prepare()
@@ -29,6 +93,7 @@ class CheesePizza: public Pizza
 		std::cout << "Prepare Cheese Pizza\n";
 	}
 };
+static PizzaRegistrar<CheesePizza> cheese_registrar(pizzaRegistry(), "cheese");
 
 class GreekPizza : public Pizza
 {
@@ -37,6 +102,7 @@ class GreekPizza : public Pizza
 		std::cout << "Prepare Greek Pizza\n";
 	}
 };
+static PizzaRegistrar<GreekPizza> greek_registrar(pizzaRegistry(), "greek");
 
 class PepperoniPizza : public Pizza
 {
@@ -45,24 +111,74 @@ class PepperoniPizza : public Pizza
 		std::cout << "Prepare Pepperoni Pizza\n";
 	}
 };
+static PizzaRegistrar<PepperoniPizza> pepperoni_registrar(pizzaRegistry(), "pepperoni");
 
 class SimplePizzaFactory
 {
 public:
-	Pizza* createPizza(const std::string& pizza_type)
-	{
-		Pizza* pizza_ = nullptr;
-		if (pizza_type == "cheese")
-			pizza_ = new(std::nothrow) CheesePizza();
-		else if (pizza_type == "greek")
-			pizza_ = new(std::nothrow) GreekPizza();
-		else if (pizza_type == "pepperoni")
-			pizza_ = new(std::nothrow) PepperoniPizza();
+	PizzaHandle createPizza(std::string_view pizza_type)
+	{
+		PizzaHandle pizza_;
+		if (const PizzaType* type = pizzaRegistry().find(pizza_type))
+			pizza_ = type->acquire();
 		return pizza_;
 	}
+	// nullptr for an unknown type
+	const PizzaType* findType(std::string_view pizza_type)
+	{
+		return pizzaRegistry().find(pizza_type);
+	}
 
 };
 
+// The result of PizzaStore::orderPizzas: one pizza per order in the order they were placed, nullptr where
+// the type was unknown. The pizzas of each product live next to each other in a single block owned by the
+// batch, and are destroyed with it.
+class PizzaBatch
+{
+public:
+	PizzaBatch() = default;
+	PizzaBatch(PizzaBatch&&) = default;
+	PizzaBatch& operator=(PizzaBatch&& other) noexcept
+	{
+		pizzas_.swap(other.pizzas_);
+		grouped_.swap(other.grouped_);
+		groups_.swap(other.groups_);
+		return *this;
+	}
+	PizzaBatch(const PizzaBatch&) = delete;
+	PizzaBatch& operator=(const PizzaBatch&) = delete;
+	~PizzaBatch()
+	{
+		for (const Group& group : groups_)
+		{
+			if (group.storage == nullptr)
+				continue;
+			for (std::size_t i = 0; i < group.count; ++i)
+				grouped_[group.first + i]->~Pizza();
+			::operator delete(group.storage, std::align_val_t(group.type->alignment));
+		}
+	}
+
+	std::size_t size() const { return pizzas_.size(); }
+	Pizza* operator[](std::size_t index) const { return pizzas_[index]; }
+
+private:
+	friend class PizzaStore;
+	// grouped_[first, first + count) are the pizzas built in storage, in the order they were placed
+	struct Group
+	{
+		const PizzaType* type = nullptr;
+		std::size_t first = 0;
+		std::size_t count = 0;
+		void* storage = nullptr;
+	};
+
+	std::vector<Pizza*> pizzas_;
+	std::vector<Pizza*> grouped_;
+	std::vector<Group> groups_;
+};
+
 class PizzaStore
 {
 	SimplePizzaFactory* factory_;
@@ -71,9 +187,10 @@ public:
 	{
 		
 	}
-	Pizza* orderPizza(const std::string& pizza_type)
+	// The pizza goes back to its pool when the returned handle is released
+	PizzaHandle orderPizza(std::string_view pizza_type)
 	{
-		Pizza* pizza_ = nullptr;
+		PizzaHandle pizza_;
 		pizza_ = factory_->createPizza(pizza_type);
 		if (nullptr != pizza_)
 		{
@@ -85,15 +202,112 @@ public:
 
 		return pizza_;
 	}
+	// Takes many orders at once. Orders are grouped by product, each group is constructed in one
+	// allocation, and each stage runs over a whole group before the next stage starts, so the same
+	// prepare() is called back to back on neighbouring objects.
+	PizzaBatch orderPizzas(const std::string_view* pizza_types, std::size_t count)
+	{
+		static constexpr std::size_t kNoGroup = static_cast<std::size_t>(-1);
+		PizzaBatch batch;
+		batch.pizzas_.assign(count, nullptr);
+
+		// Resolve each order once and count the orders for each product. There are only a few
+		// products, so a linear search over the groups is cheaper than a map.
+		std::vector<std::size_t> group_of(count, kNoGroup);
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			const PizzaType* type = factory_->findType(pizza_types[i]);
+			if (type == nullptr)
+				continue;
+			std::size_t g = 0;
+			while (g < batch.groups_.size() && batch.groups_[g].type != type)
+				++g;
+			if (g == batch.groups_.size())
+				batch.groups_.push_back({ type });
+			++batch.groups_[g].count;
+			group_of[i] = g;
+		}
+
+		std::size_t total = 0;
+		for (PizzaBatch::Group& group : batch.groups_)
+		{
+			group.first = total;
+			total += group.count;
+			group.storage = ::operator new(group.count * group.type->size,
+				std::align_val_t(group.type->alignment), std::nothrow);
+		}
+		batch.grouped_.assign(total, nullptr);
+
+		// Construct in order, so each group's pizzas fill its block from the front
+		std::vector<std::size_t> built(batch.groups_.size(), 0);
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			std::size_t g = group_of[i];
+			if (g == kNoGroup || batch.groups_[g].storage == nullptr)
+				continue;
+			const PizzaBatch::Group& group = batch.groups_[g];
+			void* storage = static_cast<unsigned char*>(group.storage) + built[g] * group.type->size;
+			Pizza* pizza = group.type->constructAt(storage);
+			batch.grouped_[group.first + built[g]] = pizza;
+			batch.pizzas_[i] = pizza;
+			++built[g];
+		}
+
+		for (const PizzaBatch::Group& group : batch.groups_)
+		{
+			if (group.storage == nullptr)
+				continue;
+			Pizza* const* first = batch.grouped_.data() + group.first;
+			Pizza* const* last = first + group.count;
+			for (Pizza* const* pizza = first; pizza != last; ++pizza)
+				(*pizza)->prepare();
+			for (Pizza* const* pizza = first; pizza != last; ++pizza)
+				(*pizza)->bake();
+			for (Pizza* const* pizza = first; pizza != last; ++pizza)
+				(*pizza)->cut();
+			for (Pizza* const* pizza = first; pizza != last; ++pizza)
+				(*pizza)->box();
+		}
+		return batch;
+	}
+	PizzaBatch orderPizzas(const std::vector<std::string_view>& pizza_types)
+	{
+		return orderPizzas(pizza_types.data(), pizza_types.size());
+	}
 	~PizzaStore() = default;
 };
 
 
+// Fills a registry to kCapacity with generated names, checks that each one is found with its own creator,
+// and that one more name and an unknown name are refused
+bool checkRegistryCapacity()
+{
+	using NameRegistry = ProductRegistry<Pizza, Pizza*, const std::string*>;
+	std::vector<std::string> names;
+	for (std::size_t i = 0; i <= NameRegistry::kCapacity; ++i)
+		names.push_back("pizza_" + std::to_string(i));
+	NameRegistry registry;
+	std::size_t registered = 0;
+	for (std::size_t i = 0; i < NameRegistry::kCapacity; ++i)
+		if (registry.add(names[i], &names[i]))
+			++registered;
+	std::size_t found = 0;
+	for (std::size_t i = 0; i < NameRegistry::kCapacity; ++i)
+		if (registry.find(names[i]) == &names[i])
+			++found;
+	bool ok = registered == NameRegistry::kCapacity && found == NameRegistry::kCapacity
+		&& !registry.add(names.back(), &names.back()) && registry.find(names.back()) == nullptr;
+	std::cout << "registry: " << registered << " of " << NameRegistry::kCapacity << " names registered, "
+		<< found << " found\n";
+	return ok;
+}
+
 /*int main()
 {
 	//const auto factory = new SimplePizzaFactory();
 	const auto factory = std::make_shared<SimplePizzaFactory>();
 	PizzaStore ny_pizza_store(factory.get());
 	ny_pizza_store.orderPizza("greek");
+	checkRegistryCapacity();
 	return 0;
 }*/
\ No newline at end of file
@@ -1,5 +1,17 @@
 #include<vector>
 #include<iostream>
+#include<algorithm>
+#include<atomic>
+#include<chrono>
+#include<cmath>
+#include<cstddef>
+#include<cstdint>
+#include<fstream>
+#include<memory>
+#include<random>
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+#include<immintrin.h>
+#endif
 
 /*
 class Square {
@@ -42,23 +54,41 @@ class Circle {
 // the open-closed Solid Principle
 //Your design should use inheritance in this case as follows:
 
+class Framebuffer;
+
 class Shape {
 public:
 	virtual void render() = 0;
+	// Draws the shape into target, clipped to its bounds
+	virtual void rasterize(Framebuffer& target) const = 0;
+	virtual ~Shape() = default;
 };
 
+// Positions and sizes are in pixels, with (0, 0) the top left corner; colors are packed with Framebuffer::rgba
 class Square: public Shape {
 public:
+	Square(float x = 0.0f, float y = 0.0f, float size = 1.0f, std::uint32_t color = 0xFFFFFFFF)
+		: x_(x), y_(y), size_(size), color_(color) {}
 	virtual void render() override {
 		std::cout << "rendering square" << "\n";
 	}
+	virtual void rasterize(Framebuffer& target) const override;
+private:
+	float x_, y_, size_;
+	std::uint32_t color_;
 };
 
 class Circle : public Shape {
 public:
+	Circle(float center_x = 0.0f, float center_y = 0.0f, float radius = 1.0f, std::uint32_t color = 0xFFFFFFFF)
+		: center_x_(center_x), center_y_(center_y), radius_(radius), color_(color) {}
 	virtual void render() override {
 		std::cout << "rendering circle" << "\n";
 	}
+	virtual void rasterize(Framebuffer& target) const override;
+private:
+	float center_x_, center_y_, radius_;
+	std::uint32_t color_;
 };
 
 class Renderer {
@@ -72,18 +102,357 @@ void Renderer::render(const std::vector<Shape*>& shapes) {
 	}
 }
 
+// The vector<Shape*> above costs a pointer chase and a virtual call per shape, and a vector<Shape> cannot
+// hold shapes at all without slicing them. ShapeCollection keeps the shapes by value instead, one
+// contiguous segment per concrete type. Rendering makes one virtual call per segment, and inside the
+// segment the concrete type is known, so the loop calls render() directly and the compiler can inline it.
+// A new shape type still needs no change to the Renderer: its segment is created the first time one is added.
+
+class ShapeSegmentBase {
+public:
+	virtual void renderAll() = 0;
+	virtual void rasterizeAll(Framebuffer& target) = 0;
+	virtual std::size_t size() const = 0;
+	virtual ~ShapeSegmentBase() = default;
+};
+
+template<class T>
+class ShapeSegment : public ShapeSegmentBase {
+public:
+	void renderAll() override {
+		for (T& shape : shapes_) {
+			shape.T::render();
+		}
+	}
+	void rasterizeAll(Framebuffer& target) override {
+		for (const T& shape : shapes_) {
+			shape.T::rasterize(target);
+		}
+	}
+	std::size_t size() const override { return shapes_.size(); }
+	T& add(const T& shape) {
+		shapes_.push_back(shape);
+		return shapes_.back();
+	}
+	std::vector<T>& shapes() { return shapes_; }
+private:
+	std::vector<T> shapes_;
+};
+
+class ShapeCollection {
+public:
+	template<class T>
+	T& add(const T& shape) {
+		return segment<T>().add(shape);
+	}
+	template<class T>
+	ShapeSegment<T>& segment() {
+		std::size_t index = segmentIndex<T>();
+		if (index >= segments_.size())
+			segments_.resize(index + 1);
+		if (!segments_[index])
+			segments_[index].reset(new ShapeSegment<T>());
+		return static_cast<ShapeSegment<T>&>(*segments_[index]);
+	}
+	// Segments in a fixed order; empty entries are types this collection has never held
+	const std::vector<std::unique_ptr<ShapeSegmentBase>>& segments() const { return segments_; }
+	std::size_t size() const {
+		std::size_t total = 0;
+		for (auto& segment : segments_) {
+			if (segment)
+				total += segment->size();
+		}
+		return total;
+	}
+private:
+	// Each shape type gets the next index the first time any collection sees it
+	template<class T>
+	static std::size_t segmentIndex() {
+		static const std::size_t index = next_segment_index_.fetch_add(1, std::memory_order_relaxed);
+		return index;
+	}
+	static std::atomic<std::size_t> next_segment_index_;
+
+	std::vector<std::unique_ptr<ShapeSegmentBase>> segments_;
+};
+
+std::atomic<std::size_t> ShapeCollection::next_segment_index_(0);
+
+class SegmentedRenderer {
+public:
+	void render(ShapeCollection& shapes);
+	void rasterize(ShapeCollection& shapes, Framebuffer& target);
+};
+
+void SegmentedRenderer::render(ShapeCollection& shapes) {
+	for (auto& segment : shapes.segments()) {
+		if (segment)
+			segment->renderAll();
+	}
+}
+
+void SegmentedRenderer::rasterize(ShapeCollection& shapes, Framebuffer& target) {
+	for (auto& segment : shapes.segments()) {
+		if (segment)
+			segment->rasterizeAll(target);
+	}
+}
+
+// An in-memory RGBA image, one 32-bit pixel per position with the bytes in R, G, B, A order, drawn by
+// Shape::rasterize. Shapes are opaque: a covered pixel takes the shape's color. The inner loops use
+// AVX2 (8 pixels at a time) when the compiler targets it, SSE2 (4 pixels) otherwise on x86, and plain
+// C++ elsewhere.
+class Framebuffer {
+public:
+	Framebuffer(int width, int height)
+		: width_(width > 0 ? width : 0), height_(height > 0 ? height : 0),
+		pixels_(static_cast<std::size_t>(width_) * height_, 0) {}
+
+	static constexpr std::uint32_t rgba(std::uint8_t r, std::uint8_t g, std::uint8_t b, std::uint8_t a = 255) {
+		return static_cast<std::uint32_t>(r) | static_cast<std::uint32_t>(g) << 8
+			| static_cast<std::uint32_t>(b) << 16 | static_cast<std::uint32_t>(a) << 24;
+	}
+
+	int width() const { return width_; }
+	int height() const { return height_; }
+	std::uint32_t pixel(int x, int y) const { return pixels_[static_cast<std::size_t>(y) * width_ + x]; }
+	std::uint32_t* row(int y) { return pixels_.data() + static_cast<std::size_t>(y) * width_; }
+
+	void clear(std::uint32_t color) {
+		for (int y = 0; y < height_; ++y)
+			fillSpan(row(y), static_cast<std::size_t>(width_), color);
+	}
+	// Fills the pixels whose centers lie inside [x0, x1) x [y0, y1)
+	void fillRect(float x0, float y0, float x1, float y1, std::uint32_t color) {
+		int left = clampToPixels(std::ceil(x0 - 0.5f), width_);
+		int right = clampToPixels(std::ceil(x1 - 0.5f), width_);
+		int top = clampToPixels(std::ceil(y0 - 0.5f), height_);
+		int bottom = clampToPixels(std::ceil(y1 - 0.5f), height_);
+		if (left >= right)
+			return;
+		for (int y = top; y < bottom; ++y)
+			fillSpan(row(y) + left, static_cast<std::size_t>(right - left), color);
+	}
+	// Fills the pixels whose centers lie inside the circle. Each row tests a whole vector of pixel centers
+	// against the radius at once and stores the color only where the test passed.
+	void fillCircle(float center_x, float center_y, float radius, std::uint32_t color) {
+		if (!(radius > 0.0f))
+			return;
+		int left = clampToPixels(std::floor(center_x - radius), width_);
+		int right = clampToPixels(std::ceil(center_x + radius), width_);
+		int top = clampToPixels(std::floor(center_y - radius), height_);
+		int bottom = clampToPixels(std::ceil(center_y + radius), height_);
+		float radius2 = radius * radius;
+		for (int y = top; y < bottom; ++y) {
+			float dy = y + 0.5f - center_y;
+			float dy2 = dy * dy;
+			std::uint32_t* pixels = row(y);
+			int x = left;
+#if defined(__AVX2__)
+			const __m256 offsets = _mm256_setr_ps(0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f);
+			const __m256 center8 = _mm256_set1_ps(center_x);
+			const __m256 dy2_8 = _mm256_set1_ps(dy2);
+			const __m256 radius2_8 = _mm256_set1_ps(radius2);
+			const __m256i color8 = _mm256_set1_epi32(static_cast<int>(color));
+			for (; x + 8 <= right; x += 8) {
+				__m256 dx = _mm256_sub_ps(_mm256_add_ps(_mm256_set1_ps(static_cast<float>(x)), offsets), center8);
+				__m256 distance2 = _mm256_add_ps(_mm256_mul_ps(dx, dx), dy2_8);
+				__m256i inside = _mm256_castps_si256(_mm256_cmp_ps(distance2, radius2_8, _CMP_LE_OQ));
+				_mm256_maskstore_epi32(reinterpret_cast<int*>(pixels + x), inside, color8);
+			}
+#elif defined(__SSE2__) || defined(_M_X64)
+			const __m128 offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+			const __m128 center4 = _mm_set1_ps(center_x);
+			const __m128 dy2_4 = _mm_set1_ps(dy2);
+			const __m128 radius2_4 = _mm_set1_ps(radius2);
+			const __m128i color4 = _mm_set1_epi32(static_cast<int>(color));
+			for (; x + 4 <= right; x += 4) {
+				__m128 dx = _mm_sub_ps(_mm_add_ps(_mm_set1_ps(static_cast<float>(x)), offsets), center4);
+				__m128 distance2 = _mm_add_ps(_mm_mul_ps(dx, dx), dy2_4);
+				__m128i inside = _mm_castps_si128(_mm_cmple_ps(distance2, radius2_4));
+				__m128i* target = reinterpret_cast<__m128i*>(pixels + x);
+				__m128i old = _mm_loadu_si128(target);
+				_mm_storeu_si128(target, _mm_or_si128(_mm_and_si128(inside, color4), _mm_andnot_si128(inside, old)));
+			}
+#endif
+			for (; x < right; ++x) {
+				float dx = x + 0.5f - center_x;
+				if (dx * dx + dy2 <= radius2)
+					pixels[x] = color;
+			}
+		}
+	}
+
+	// Binary PPM (P6); alpha is dropped. Returns false if the file cannot be written.
+	bool writePPM(const char* path) const {
+		std::ofstream out(path, std::ios::binary);
+		if (!out)
+			return false;
+		out << "P6\n" << width_ << " " << height_ << "\n255\n";
+		std::vector<unsigned char> line(static_cast<std::size_t>(width_) * 3);
+		for (int y = 0; y < height_; ++y) {
+			const std::uint32_t* pixels = pixels_.data() + static_cast<std::size_t>(y) * width_;
+			for (int x = 0; x < width_; ++x) {
+				line[3 * x] = static_cast<unsigned char>(pixels[x]);
+				line[3 * x + 1] = static_cast<unsigned char>(pixels[x] >> 8);
+				line[3 * x + 2] = static_cast<unsigned char>(pixels[x] >> 16);
+			}
+			out.write(reinterpret_cast<const char*>(line.data()), static_cast<std::streamsize>(line.size()));
+		}
+		return static_cast<bool>(out);
+	}
+
+private:
+	// Clamps to [0, limit] while still a float: converting an out-of-range float or NaN to int is
+	// undefined. NaN becomes 0, so a shape with a NaN coordinate covers nothing.
+	static int clampToPixels(float value, int limit) {
+		if (!(value > 0.0f))
+			return 0;
+		if (value >= static_cast<float>(limit))
+			return limit;
+		return static_cast<int>(value);
+	}
+	static void fillSpan(std::uint32_t* pixels, std::size_t count, std::uint32_t color) {
+		std::size_t i = 0;
+#if defined(__AVX2__)
+		const __m256i color8 = _mm256_set1_epi32(static_cast<int>(color));
+		for (; i + 8 <= count; i += 8)
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(pixels + i), color8);
+#elif defined(__SSE2__) || defined(_M_X64)
+		const __m128i color4 = _mm_set1_epi32(static_cast<int>(color));
+		for (; i + 4 <= count; i += 4)
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(pixels + i), color4);
+#endif
+		for (; i < count; ++i)
+			pixels[i] = color;
+	}
+
+	int width_;
+	int height_;
+	std::vector<std::uint32_t> pixels_;
+};
+
+void Square::rasterize(Framebuffer& target) const {
+	target.fillRect(x_, y_, x_ + size_, y_ + size_, color_);
+}
+
+void Circle::rasterize(Framebuffer& target) const {
+	target.fillCircle(center_x_, center_y_, radius_, color_);
+}
+
+// Checks pixels of the demo frame in main: inside, on the edge of and just outside each shape, plus the
+// background. Also rasterizes shapes that are huge, far off-frame or NaN into a scratch frame, which must
+// stay untouched apart from the one shape that covers it.
+bool checkDemoFrame(const Framebuffer& frame) {
+	struct Expected {
+		int x;
+		int y;
+		std::uint32_t color;
+	};
+	const std::uint32_t white = Framebuffer::rgba(255, 255, 255);
+	const Expected expected[] = {
+		{ 0, 0, white }, { 49, 39, white },
+		{ 4, 4, Framebuffer::rgba(255, 0, 0) }, { 13, 13, Framebuffer::rgba(255, 0, 0) }, { 14, 4, white }, { 3, 4, white },
+		{ 24, 8, Framebuffer::rgba(0, 255, 0) }, { 40, 8, Framebuffer::rgba(0, 0, 255) }, { 46, 8, white },
+		{ 9, 30, Framebuffer::rgba(255, 255, 0) }, { 3, 30, Framebuffer::rgba(255, 255, 0) }, { 2, 30, white },
+		{ 9, 23, white }, { 25, 30, Framebuffer::rgba(0, 255, 255) }, { 41, 30, Framebuffer::rgba(255, 0, 255) },
+	};
+	std::size_t mismatches = 0;
+	for (const Expected& e : expected)
+		if (frame.pixel(e.x, e.y) != e.color)
+			++mismatches;
+
+	const float nan = std::nanf("");
+	// Odd dimensions, so the scalar tails after the vector loops are exercised too
+	Framebuffer scratch(17, 13);
+	scratch.clear(white);
+	Square(1e12f, 1e12f, 10, 0).rasterize(scratch);
+	Square(-1e12f, 2, 10, 0).rasterize(scratch);
+	Square(nan, 2, 10, 0).rasterize(scratch);
+	Circle(nan, 8, 4, 0).rasterize(scratch);
+	Circle(8, 8, nan, 0).rasterize(scratch);
+	Circle(-1e12f, -1e12f, 1e6f, 0).rasterize(scratch);
+	Square(4, 4, 1e12f, Framebuffer::rgba(0, 0, 0)).rasterize(scratch);
+	for (int y = 0; y < scratch.height(); ++y)
+		for (int x = 0; x < scratch.width(); ++x)
+			if (scratch.pixel(x, y) != (x >= 4 && y >= 4 ? Framebuffer::rgba(0, 0, 0) : white))
+				++mismatches;
+
+	std::cout << "rasterizer: " << (mismatches == 0 ? "all checked pixels match\n" : "checked pixels differ\n");
+	return mismatches == 0;
+}
+
+#if defined(RASTERIZER_BENCHMARKS)
+// Frames per second for 10k, 100k and 1M random squares and circles (half each, 2 to 16 pixels across)
+// drawn into a width x height framebuffer. Each size runs for about a second.
+void benchmarkRasterizer(int width = 1920, int height = 1080) {
+	using Clock = std::chrono::steady_clock;
+	std::mt19937 random(12345);
+	std::uniform_real_distribution<float> x_position(0.0f, static_cast<float>(width));
+	std::uniform_real_distribution<float> y_position(0.0f, static_cast<float>(height));
+	std::uniform_real_distribution<float> extent(2.0f, 16.0f);
+	std::uniform_int_distribution<std::uint32_t> channel(0, 255);
+
+	Framebuffer target(width, height);
+	SegmentedRenderer renderer;
+	for (std::size_t count : { 10000, 100000, 1000000 }) {
+		ShapeCollection shapes;
+		for (std::size_t i = 0; i < count; ++i) {
+			std::uint32_t color = Framebuffer::rgba(static_cast<std::uint8_t>(channel(random)),
+				static_cast<std::uint8_t>(channel(random)), static_cast<std::uint8_t>(channel(random)));
+			float size = extent(random);
+			if (i % 2 == 0)
+				shapes.add(Square(x_position(random), y_position(random), size, color));
+			else
+				shapes.add(Circle(x_position(random), y_position(random), size / 2, color));
+		}
+		int frames = 0;
+		auto start = Clock::now();
+		std::chrono::duration<double> elapsed(0.0);
+		while (frames < 3 || elapsed.count() < 1.0) {
+			target.clear(Framebuffer::rgba(0, 0, 0));
+			renderer.rasterize(shapes, target);
+			++frames;
+			elapsed = Clock::now() - start;
+		}
+		std::cout << count << " shapes: " << frames / elapsed.count() << " fps\n";
+	}
+}
+#endif
+
 int main(){
-	Square s1, s2, s3;
-	Circle c1, c2, c3;
+	Square s1(4, 4, 10, Framebuffer::rgba(255, 0, 0)), s2(20, 4, 10, Framebuffer::rgba(0, 255, 0)),
+		s3(36, 4, 10, Framebuffer::rgba(0, 0, 255));
+	Circle c1(9, 30, 6, Framebuffer::rgba(255, 255, 0)), c2(25, 30, 6, Framebuffer::rgba(0, 255, 255)),
+		c3(41, 30, 6, Framebuffer::rgba(255, 0, 255));
 	std::vector<Shape*> s;
 	s.push_back(&s1);
 	s.push_back(&s2);
 	s.push_back(&s3);
-	std::vector<Shape> c;
-	c.push_back(c1);
-	c.push_back(c2);
-	c.push_back(c3);
+	ShapeCollection c;
+	c.add(c1);
+	c.add(c2);
+	c.add(c3);
+	c.add(s1);
+	c.add(s2);
+	c.add(s3);
 	Renderer r;
 	r.render(s);
+	SegmentedRenderer sr;
+	sr.render(c);
+
+	Framebuffer frame(50, 40);
+	frame.clear(Framebuffer::rgba(255, 255, 255));
+	sr.rasterize(c, frame);
+	bool ok = checkDemoFrame(frame);
+	if (!frame.writePPM("shapes.ppm")) {
+		std::cout << "could not write shapes.ppm\n";
+		ok = false;
+	}
 
+	// Runs for several seconds, so it is built only with RASTERIZER_BENCHMARKS defined
+#if defined(RASTERIZER_BENCHMARKS)
+	benchmarkRasterizer();
+#endif
+	return ok ? 0 : 1;
 }
\ No newline at end of file
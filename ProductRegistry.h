@@ -0,0 +1,265 @@
+// Infrastructure shared by the factories in FactoryPattern.cpp and FactoryMethodPattern.cpp: a registry
+// that maps product names to creators through a perfect hash, and a pool that recycles products of one
+// concrete type. Both are templates over the product base class, so each file keeps its own Pizza.
+#pragma once
+
+#include<algorithm>
+#include<cstddef>
+#include<cstdint>
+#include<memory>
+#include<mutex>
+#include<new>
+#include<string_view>
+#include<vector>
+
+// FNV-1a. It is constexpr, so the hash of a product name written as a literal is computed by the compiler.
+constexpr std::uint64_t productHash(std::string_view name)
+{
+	std::uint64_t hash = 14695981039346656037ull;
+	for (char c : name)
+	{
+		hash ^= static_cast<unsigned char>(c);
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+// A product name together with its hash; constexpr ProductKey kCheese("cheese") costs nothing at runtime
+struct ProductKey
+{
+	constexpr ProductKey(std::string_view product_name) : name(product_name), hash(productHash(product_name)) {}
+	std::string_view name;
+	std::uint64_t hash;
+};
+
+// Maps product names to creator functions through a perfect hash built by hash-and-displace (CHD): keys
+// are split into small buckets, and each bucket gets its own displacement, chosen so that all of the
+// bucket's keys land in slots no other key uses. Buckets are placed largest first, so a registry can
+// always be filled to kCapacity (the table has twice as many slots). find() reads one displacement and
+// probes exactly one slot, and never allocates.
+// Products register themselves, so adding one does not touch the factory that creates them.
+// Names must refer to storage that outlives the registry (string literals). Creator is normally a
+// function, but may be a pointer to a descriptor that carries the creator along with other per-product data.
+template<class Product, class Handle = Product*, class CreatorType = Handle (*)()>
+class ProductRegistry
+{
+public:
+	using Creator = CreatorType;
+	static constexpr std::size_t kCapacity = 64;
+
+	// Returns false if the name is already registered, the registry is full, or (in practice never) no
+	// displacement places some bucket
+	bool add(std::string_view name, Creator creator)
+	{
+		ProductKey key(name);
+		if (count_ == kCapacity || find(key) != nullptr)
+			return false;
+		keys_[count_] = { key.name, key.hash, creator };
+		++count_;
+		if (rebuild())
+			return true;
+		--count_;
+		rebuild();
+		return false;
+	}
+	Creator find(const ProductKey& key) const
+	{
+		const Entry& entry = table_[slot(key.hash, displacement_[bucket(key.hash)])];
+		if (entry.creator != nullptr && entry.hash == key.hash && entry.name == key.name)
+			return entry.creator;
+		return nullptr;
+	}
+	Creator find(std::string_view name) const
+	{
+		return find(ProductKey(name));
+	}
+
+private:
+	static constexpr std::size_t kSlots = 2 * kCapacity;
+	static constexpr std::size_t kBuckets = kCapacity / 2;
+	static constexpr std::uint32_t kMaxDisplacement = 1u << 16;
+
+	struct Entry
+	{
+		std::string_view name;
+		std::uint64_t hash = 0;
+		Creator creator = nullptr;
+	};
+
+	static std::uint64_t mix(std::uint64_t x)
+	{
+		x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+		x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+		return x ^ (x >> 31);
+	}
+	static std::size_t bucket(std::uint64_t hash)
+	{
+		return static_cast<std::size_t>(mix(hash) >> 32) & (kBuckets - 1);
+	}
+	static std::size_t slot(std::uint64_t hash, std::uint32_t displacement)
+	{
+		return static_cast<std::size_t>(mix(hash ^ ((displacement + 1ull) * 0x9E3779B97F4A7C15ull))) & (kSlots - 1);
+	}
+	// Places the buckets largest first, each at the first displacement whose slots are all still free
+	bool rebuild()
+	{
+		std::uint8_t members[kBuckets][kCapacity];
+		std::size_t sizes[kBuckets] = {};
+		for (std::size_t i = 0; i < count_; ++i)
+		{
+			std::size_t b = bucket(keys_[i].hash);
+			members[b][sizes[b]++] = static_cast<std::uint8_t>(i);
+		}
+		std::size_t order[kBuckets];
+		for (std::size_t b = 0; b < kBuckets; ++b)
+			order[b] = b;
+		std::sort(order, order + kBuckets, [&](std::size_t x, std::size_t y) { return sizes[x] > sizes[y]; });
+
+		Entry table[kSlots];
+		std::uint32_t displacement[kBuckets] = {};
+		for (std::size_t b : order)
+		{
+			if (sizes[b] == 0)
+				break;
+			std::uint32_t d = 0;
+			for (; d < kMaxDisplacement; ++d)
+			{
+				std::size_t placed = 0;
+				for (; placed < sizes[b]; ++placed)
+				{
+					const Entry& key = keys_[members[b][placed]];
+					Entry& entry = table[slot(key.hash, d)];
+					if (entry.creator != nullptr)
+						break;
+					entry = key;
+				}
+				if (placed == sizes[b])
+					break;
+				// Undo the keys of this bucket placed at d before trying the next displacement
+				while (placed-- > 0)
+					table[slot(keys_[members[b][placed]].hash, d)] = Entry();
+			}
+			if (d == kMaxDisplacement)
+				return false;
+			displacement[b] = d;
+		}
+		for (std::size_t i = 0; i < kSlots; ++i)
+			table_[i] = table[i];
+		for (std::size_t b = 0; b < kBuckets; ++b)
+			displacement_[b] = displacement[b];
+		return true;
+	}
+
+	Entry table_[kSlots];
+	std::uint32_t displacement_[kBuckets] = {};
+	Entry keys_[kCapacity];
+	std::size_t count_ = 0;
+};
+
+// Hands a product back to the ProductPool of its concrete type instead of deleting it
+template<class Product>
+struct ProductRecycler
+{
+	void (*recycle)(Product*) = nullptr;
+	void operator()(Product* product) const { recycle(product); }
+};
+template<class Product>
+using PooledHandle = std::unique_ptr<Product, ProductRecycler<Product>>;
+
+// Recycles products of one concrete type T derived from Product. acquire() takes one from a per-thread
+// cache, then from a shared free list, and only allocates when both are empty. When the handle is
+// released the product is reset() and returned to the releasing thread's cache, which spills half of
+// itself to the shared list when full. Products are reset, never reconstructed.
+template<class Product, class T>
+class ProductPool
+{
+public:
+	using Handle = PooledHandle<Product>;
+	static constexpr std::size_t kLocalCapacity = 64;
+
+	static Handle acquire()
+	{
+		std::vector<T*>& local = localCache().products;
+		if (local.empty())
+			refill(local);
+		T* product = nullptr;
+		if (!local.empty())
+		{
+			product = local.back();
+			local.pop_back();
+		}
+		else
+		{
+			product = new(std::nothrow) T();
+		}
+		return Handle(product, ProductRecycler<Product>{ &recycle });
+	}
+	// A pooled product copy-assigned from prototype, which must be a T. The copy reuses the pooled
+	// product's buffers (strings, for instance), so once the pool is warm it does not allocate.
+	static Handle clone(const Product& prototype)
+	{
+		Handle product = acquire();
+		if (product != nullptr)
+			*static_cast<T*>(product.get()) = static_cast<const T&>(prototype);
+		return product;
+	}
+	static void recycle(Product* product)
+	{
+		T* concrete = static_cast<T*>(product);
+		concrete->reset();
+		std::vector<T*>& local = localCache().products;
+		if (local.size() == kLocalCapacity)
+			spill(local, kLocalCapacity / 2);
+		local.push_back(concrete);
+	}
+
+private:
+	struct Shared
+	{
+		std::mutex mutex;
+		std::vector<T*> products;
+		~Shared()
+		{
+			for (T* product : products)
+				delete product;
+		}
+	};
+	// Gives the cached products to the shared list when the thread exits
+	struct LocalCache
+	{
+		std::vector<T*> products;
+		LocalCache() { products.reserve(kLocalCapacity); }
+		~LocalCache() { spill(products, products.size()); }
+	};
+
+	static Shared& shared()
+	{
+		static Shared pool;
+		return pool;
+	}
+	static LocalCache& localCache()
+	{
+		thread_local LocalCache cache;
+		return cache;
+	}
+	static void refill(std::vector<T*>& local)
+	{
+		Shared& pool = shared();
+		std::lock_guard<std::mutex> lock(pool.mutex);
+		while (!pool.products.empty() && local.size() < kLocalCapacity / 2)
+		{
+			local.push_back(pool.products.back());
+			pool.products.pop_back();
+		}
+	}
+	static void spill(std::vector<T*>& local, std::size_t count)
+	{
+		Shared& pool = shared();
+		std::lock_guard<std::mutex> lock(pool.mutex);
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			pool.products.push_back(local.back());
+			local.pop_back();
+		}
+	}
+};
@@ -39,10 +39,34 @@
 
 //Strategy Pattern
 #include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <typeinfo>
+#include <variant>
+#include <vector>
+#if defined(STRATEGY_INSTRUMENTATION) && defined(__GNUC__)
+#include <cxxabi.h>
+#endif
 class FlyBehaviour
 {
 public:
     virtual void Fly() = 0;
+    // Flies once for each of ducks ducks that share this strategy; override to do the whole range at once
+    virtual void FlyAll(std::size_t ducks)
+    {
+        for (std::size_t i = 0; i < ducks; ++i)
+            Fly();
+    }
+    virtual ~FlyBehaviour() = default;
 };
 class FlyWithWings : public FlyBehaviour
 {
@@ -66,10 +90,17 @@ class QuackBehaviour
 {
 public:
     virtual void quack() = 0;
+    virtual void quackAll(std::size_t ducks)
+    {
+        for (std::size_t i = 0; i < ducks; ++i)
+            quack();
+    }
+    virtual ~QuackBehaviour() = default;
 };
 
 class Quack : public QuackBehaviour
 {
+public:
     void quack()
     {
         std::cout << "quack\n";
@@ -78,22 +109,264 @@ class Quack : public QuackBehaviour
 
 class MuteQuack : public QuackBehaviour
 {
+public:
     void quack()
     {
         std::cout << "slience\n";
     }
 };
+
+// Flyweight registry for stateless strategies. Every duck that flies with wings can share one FlyWithWings,
+// so shared<FlyWithWings>() hands out a single instance per type. Shared instances are immortal: they are
+// never deleted, so no duck can be left pointing at a destroyed strategy during shutdown.
+// Strategies that carry state are still created with new, one per duck, as before.
+class StrategyRegistry
+{
+public:
+    template<class Strategy>
+    static Strategy* shared()
+    {
+        // A polymorphic class with no data members is the size of its vtable pointer
+        static_assert(sizeof(Strategy) == sizeof(void*), "only stateless strategies can be shared");
+        static Strategy* const instance = new Strategy();
+        return instance;
+    }
+};
+
+// Epoch-based reclamation for strategies that are swapped out while other threads may still be calling them.
+// A reader wraps its use of a strategy in an EpochReclaimer::Guard, which announces the global epoch it
+// entered in. A writer retires the old strategy instead of deleting it; a retired object is deleted once
+// the global epoch has advanced twice past its retirement, which the epoch only does when every active
+// reader has caught up, so by then no reader can still hold it.
+class EpochReclaimer
+{
+public:
+    class Guard
+    {
+    public:
+        Guard() { enter(); }
+        ~Guard() { leave(); }
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+    };
+
+    static void retire(void* object, void (*deleter)(void*))
+    {
+        Retired& retired = retiredList();
+        std::lock_guard<std::mutex> lock(retired.mutex);
+        retired.objects.push_back({ object, deleter, globalEpoch().load(std::memory_order_seq_cst) });
+        collectLocked(retired);
+    }
+    // Deletes whatever retired objects are no longer reachable by any reader
+    static void collect()
+    {
+        Retired& retired = retiredList();
+        std::lock_guard<std::mutex> lock(retired.mutex);
+        collectLocked(retired);
+    }
+
+private:
+    // Per-thread announcement: 0 when outside any Guard, otherwise (epoch << 1) | 1
+    struct alignas(64) Record
+    {
+        std::atomic<std::uint64_t> state{ 0 };
+        std::atomic<bool> in_use{ true };
+        Record* next = nullptr;
+        unsigned depth = 0;
+    };
+    struct RetiredObject
+    {
+        void* object;
+        void (*deleter)(void*);
+        std::uint64_t epoch;
+    };
+    struct Retired
+    {
+        std::mutex mutex;
+        std::vector<RetiredObject> objects;
+        ~Retired()
+        {
+            for (RetiredObject& r : objects)
+                r.deleter(r.object);
+        }
+    };
+    // Gives the record back for reuse when its thread exits
+    struct RecordOwner
+    {
+        Record* record = nullptr;
+        ~RecordOwner()
+        {
+            if (record)
+                record->in_use.store(false, std::memory_order_release);
+        }
+    };
+
+    static std::atomic<std::uint64_t>& globalEpoch()
+    {
+        static std::atomic<std::uint64_t> epoch(1);
+        return epoch;
+    }
+    static std::atomic<Record*>& records()
+    {
+        static std::atomic<Record*> head(nullptr);
+        return head;
+    }
+    static Retired& retiredList()
+    {
+        static Retired retired;
+        return retired;
+    }
+    // Records are never freed; a thread reuses the record of an exited thread or pushes a new one
+    static Record& localRecord()
+    {
+        thread_local RecordOwner owner;
+        if (owner.record == nullptr)
+        {
+            for (Record* r = records().load(std::memory_order_acquire); r != nullptr && owner.record == nullptr; r = r->next)
+            {
+                bool expected = false;
+                if (r->in_use.compare_exchange_strong(expected, true, std::memory_order_acq_rel))
+                    owner.record = r;
+            }
+            if (owner.record == nullptr)
+            {
+                Record* r = new Record();
+                r->next = records().load(std::memory_order_relaxed);
+                while (!records().compare_exchange_weak(r->next, r, std::memory_order_acq_rel))
+                {
+                }
+                owner.record = r;
+            }
+        }
+        return *owner.record;
+    }
+    static void enter()
+    {
+        Record& record = localRecord();
+        if (record.depth++ == 0)
+        {
+            record.state.store(globalEpoch().load(std::memory_order_relaxed) << 1 | 1, std::memory_order_relaxed);
+            // The announcement must be visible before this thread loads any strategy pointer
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+    }
+    static void leave()
+    {
+        Record& record = localRecord();
+        if (--record.depth == 0)
+            record.state.store(0, std::memory_order_release);
+    }
+    static void collectLocked(Retired& retired)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::uint64_t epoch = globalEpoch().load(std::memory_order_seq_cst);
+        bool all_caught_up = true;
+        for (Record* r = records().load(std::memory_order_acquire); r != nullptr; r = r->next)
+        {
+            std::uint64_t state = r->state.load(std::memory_order_seq_cst);
+            if ((state & 1) && (state >> 1) != epoch)
+                all_caught_up = false;
+        }
+        if (all_caught_up)
+            globalEpoch().compare_exchange_strong(epoch, epoch + 1, std::memory_order_seq_cst);
+        epoch = globalEpoch().load(std::memory_order_seq_cst);
+
+        auto reclaimable = [epoch](const RetiredObject& r) { return r.epoch + 2 <= epoch; };
+        for (RetiredObject& r : retired.objects)
+            if (reclaimable(r))
+                r.deleter(r.object);
+        retired.objects.erase(std::remove_if(retired.objects.begin(), retired.objects.end(), reclaimable), retired.objects.end());
+    }
+};
+
+// A strategy pointer that may be swapped while other threads call through it. Readers get the current
+// strategy with a single atomic load; writers publish with a single atomic exchange. The low bit of the
+// pointer records whether the slot owns the strategy: owned strategies are retired through the
+// EpochReclaimer when replaced, while borrowed ones (such as StrategyRegistry flyweights) are left alone.
+// Every publish also bumps a per-type swap counter, so a DuckPopulation can tell that no slot of that type
+// changed without looking at its ducks.
+template<class Strategy>
+class StrategySlot
+{
+public:
+    StrategySlot() = default;
+    StrategySlot(const StrategySlot&) = delete;
+    StrategySlot& operator=(const StrategySlot&) = delete;
+    ~StrategySlot()
+    {
+        publish(0);
+    }
+    // Borrows strategy; the caller keeps it alive for as long as the slot may use it
+    StrategySlot& operator=(Strategy* strategy)
+    {
+        publish(reinterpret_cast<std::uintptr_t>(strategy));
+        return *this;
+    }
+    void reset(std::unique_ptr<Strategy> strategy)
+    {
+        static_assert(alignof(Strategy) > 1, "the low pointer bit is used as the ownership flag");
+        publish(reinterpret_cast<std::uintptr_t>(strategy.release()) | kOwned);
+    }
+    Strategy* load() const
+    {
+        return reinterpret_cast<Strategy*>(bits_.load(std::memory_order_acquire) & ~kOwned);
+    }
+    Strategy* operator->() const { return load(); }
+    // Number of publishes on any slot of this type so far. A swap is counted after the new strategy is
+    // stored and before the old one is retired.
+    static std::uint64_t swaps()
+    {
+        return swapCounter().load(std::memory_order_seq_cst);
+    }
+    explicit operator bool() const { return load() != nullptr; }
+    // Calls f with the current strategy. The slot never reclaims a borrowed strategy, so one is called
+    // with just the load; an owned one is reloaded inside an EpochReclaimer::Guard so it cannot be freed
+    // during the call. Ducks that only ever borrow (flyweights) thus pay nothing for reclamation.
+    template<class F>
+    void call(F&& f) const
+    {
+        std::uintptr_t bits = bits_.load(std::memory_order_acquire);
+        if (!(bits & kOwned))
+        {
+            f(reinterpret_cast<Strategy*>(bits));
+            return;
+        }
+        EpochReclaimer::Guard guard;
+        f(load());
+    }
+
+private:
+    static constexpr std::uintptr_t kOwned = 1;
+    void publish(std::uintptr_t bits)
+    {
+        std::uintptr_t previous = bits_.exchange(bits, std::memory_order_seq_cst);
+        swapCounter().fetch_add(1, std::memory_order_seq_cst);
+        if (previous & kOwned)
+            EpochReclaimer::retire(reinterpret_cast<void*>(previous & ~kOwned), [](void* p) { delete static_cast<Strategy*>(p); });
+    }
+    static std::atomic<std::uint64_t>& swapCounter()
+    {
+        static std::atomic<std::uint64_t> swaps(0);
+        return swaps;
+    }
+    std::atomic<std::uintptr_t> bits_{ 0 };
+};
+
+// performFly()/performQuack() may run concurrently with setFlyBehaviour()/setQuackBehaviour() on other
+// threads. Pass a std::unique_ptr to hand the duck ownership of a strategy; it is then reclaimed safely when
+// replaced. A raw pointer is borrowed, as before.
 class Duck
 {
 public:
     Duck() {}
+    virtual ~Duck() = default;
     void performFly()
     {
-        fly_behaviour_->Fly();
+        fly_behaviour_.call([](FlyBehaviour* fb) { fb->Fly(); });
     }
     void performQuack()
     {
-        quack_behaviour_->quack();
+        quack_behaviour_.call([](QuackBehaviour* qb) { qb->quack(); });
     }
     void swim()
     {
@@ -104,13 +377,23 @@ public:
     {
         fly_behaviour_ = fb;
     }
+    void setFlyBehaviour(std::unique_ptr<FlyBehaviour> fb)
+    {
+        fly_behaviour_.reset(std::move(fb));
+    }
     void setQuackBehaviour(QuackBehaviour* qb)
     {
         quack_behaviour_ = qb;
     }
+    void setQuackBehaviour(std::unique_ptr<QuackBehaviour> qb)
+    {
+        quack_behaviour_.reset(std::move(qb));
+    }
+    FlyBehaviour* getFlyBehaviour() { return fly_behaviour_.load(); }
+    QuackBehaviour* getQuackBehaviour() { return quack_behaviour_.load(); }
 protected:
-    FlyBehaviour* fly_behaviour_ = nullptr;
-    QuackBehaviour* quack_behaviour_ = nullptr;
+    StrategySlot<FlyBehaviour> fly_behaviour_;
+    StrategySlot<QuackBehaviour> quack_behaviour_;
 };
 
 
@@ -119,8 +402,8 @@ class MallardDuck : public Duck
 public:
     MallardDuck()
     {
-        fly_behaviour_ = new FlyWithWings();
-        quack_behaviour_ = new Quack();
+        fly_behaviour_ = StrategyRegistry::shared<FlyWithWings>();
+        quack_behaviour_ = StrategyRegistry::shared<Quack>();
     }
     void display()
     {
@@ -128,6 +411,797 @@ public:
     }
 };
 
+// A population of ducks kept in struct-of-arrays form and sorted by (fly, quack) strategy, so that every
+// strategy owns a contiguous range of the population. performFlyAll() then makes one FlyAll() call per
+// range instead of one indirect call per duck, jumping to a different strategy only between ranges.
+// Ducks are not owned. performFlyAll()/performQuackAll() run inside an EpochReclaimer::Guard and first
+// compare the StrategySlot swap counters with the ones seen last time. Only if a strategy of that type was
+// swapped somewhere are the ducks' strategies re-read, so a strategy swapped out on the Duck itself (and
+// possibly retired) is never called, while a population nobody touched costs two loads per batch. The
+// population is regrouped lazily when anything changed.
+// A population is used by one thread at a time; the ducks' strategies may be swapped from any thread.
+class DuckPopulation
+{
+public:
+    using Id = std::size_t;
+
+    Id add(Duck* duck)
+    {
+        Id id = slot_of_.size();
+        slot_of_.push_back(ducks_.size());
+        id_of_.push_back(id);
+        ducks_.push_back(duck);
+        fly_.push_back(duck->getFlyBehaviour());
+        quack_.push_back(duck->getQuackBehaviour());
+        grouped_ = false;
+        return id;
+    }
+    std::size_t size() const { return ducks_.size(); }
+    Duck* duck(Id id) { return ducks_[slot_of_[id]]; }
+
+    void setFlyBehaviour(Id id, FlyBehaviour* fb)
+    {
+        std::size_t slot = slot_of_[id];
+        ducks_[slot]->setFlyBehaviour(fb);
+        if (fly_[slot] != fb)
+        {
+            fly_[slot] = fb;
+            grouped_ = false;
+        }
+    }
+    void setQuackBehaviour(Id id, QuackBehaviour* qb)
+    {
+        std::size_t slot = slot_of_[id];
+        ducks_[slot]->setQuackBehaviour(qb);
+        if (quack_[slot] != qb)
+        {
+            quack_[slot] = qb;
+            grouped_ = false;
+        }
+    }
+    // Re-reads every duck's strategies, for behaviours that were changed on the Duck itself
+    void refresh()
+    {
+        for (std::size_t slot = 0; slot < ducks_.size(); ++slot)
+        {
+            fly_[slot] = ducks_[slot]->getFlyBehaviour();
+            quack_[slot] = ducks_[slot]->getQuackBehaviour();
+        }
+        grouped_ = false;
+    }
+
+    void performFlyAll()
+    {
+        EpochReclaimer::Guard guard;
+        sync();
+        regroup();
+        for (const Run& run : fly_runs_)
+            fly_[run.begin]->FlyAll(run.end - run.begin);
+    }
+    void performQuackAll()
+    {
+        EpochReclaimer::Guard guard;
+        sync();
+        regroup();
+        for (const Run& run : quack_runs_)
+            quack_[run.begin]->quackAll(run.end - run.begin);
+    }
+
+private:
+    struct Run
+    {
+        std::size_t begin;
+        std::size_t end;
+    };
+
+    // Picks up strategies changed on the ducks themselves. Called under a Guard, so the pointers read
+    // here stay valid until the guard ends even if they are swapped out meanwhile. If a counter is
+    // unchanged, no slot of that type has published since the last scan, and the cached strategies are
+    // still current or (when a swap is in flight) not yet retired, since the guard was entered before the
+    // counter was read.
+    void sync()
+    {
+        std::uint64_t fly_swaps = StrategySlot<FlyBehaviour>::swaps();
+        if (fly_swaps != fly_swaps_)
+        {
+            fly_swaps_ = fly_swaps;
+            for (std::size_t slot = 0; slot < ducks_.size(); ++slot)
+            {
+                FlyBehaviour* fb = ducks_[slot]->getFlyBehaviour();
+                if (fb != fly_[slot])
+                {
+                    fly_[slot] = fb;
+                    grouped_ = false;
+                }
+            }
+        }
+        std::uint64_t quack_swaps = StrategySlot<QuackBehaviour>::swaps();
+        if (quack_swaps != quack_swaps_)
+        {
+            quack_swaps_ = quack_swaps;
+            for (std::size_t slot = 0; slot < ducks_.size(); ++slot)
+            {
+                QuackBehaviour* qb = ducks_[slot]->getQuackBehaviour();
+                if (qb != quack_[slot])
+                {
+                    quack_[slot] = qb;
+                    grouped_ = false;
+                }
+            }
+        }
+    }
+
+    // Sorts the population by (fly, quack) strategy and records the range of every strategy. Quack ranges
+    // are split wherever the fly strategy changes, which with shared strategies means only a handful more.
+    void regroup()
+    {
+        if (grouped_)
+            return;
+        std::vector<std::size_t> order(ducks_.size());
+        for (std::size_t i = 0; i < order.size(); ++i)
+            order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [this](std::size_t a, std::size_t b) {
+            if (fly_[a] != fly_[b])
+                return std::less<FlyBehaviour*>()(fly_[a], fly_[b]);
+            return std::less<QuackBehaviour*>()(quack_[a], quack_[b]);
+        });
+        permute(ducks_, order);
+        permute(fly_, order);
+        permute(quack_, order);
+        permute(id_of_, order);
+        for (std::size_t slot = 0; slot < id_of_.size(); ++slot)
+            slot_of_[id_of_[slot]] = slot;
+
+        fly_runs_.clear();
+        quack_runs_.clear();
+        for (std::size_t slot = 0; slot < ducks_.size(); ++slot)
+        {
+            if (slot == 0 || fly_[slot] != fly_[slot - 1])
+                fly_runs_.push_back({ slot, slot });
+            if (slot == 0 || fly_[slot] != fly_[slot - 1] || quack_[slot] != quack_[slot - 1])
+                quack_runs_.push_back({ slot, slot });
+            fly_runs_.back().end = slot + 1;
+            quack_runs_.back().end = slot + 1;
+        }
+        grouped_ = true;
+    }
+    template<class T>
+    static void permute(std::vector<T>& values, const std::vector<std::size_t>& order)
+    {
+        std::vector<T> sorted;
+        sorted.reserve(values.size());
+        for (std::size_t i : order)
+            sorted.push_back(values[i]);
+        values.swap(sorted);
+    }
+
+    std::vector<Duck*> ducks_;
+    std::vector<FlyBehaviour*> fly_;
+    std::vector<QuackBehaviour*> quack_;
+    std::vector<Id> id_of_;             // slot -> id
+    std::vector<std::size_t> slot_of_;  // id -> slot
+    std::vector<Run> fly_runs_;
+    std::vector<Run> quack_runs_;
+    std::uint64_t fly_swaps_ = 0;    // StrategySlot swap counters at the last scan
+    std::uint64_t quack_swaps_ = 0;
+    bool grouped_ = true;
+};
+
+// Most ducks never change behaviour, yet every performFly() above is a virtual call through a pointer.
+// StaticDuck holds its strategies by value in std::variants of the behaviours it may use, so a call is a
+// switch on the variant index followed by a direct (qualified, non-virtual) call. Behaviours can still
+// be swapped at runtime, as long as the new one is one of the variant's alternatives.
+template<class FlyVariant, class QuackVariant>
+class StaticDuck
+{
+public:
+    StaticDuck(FlyVariant fly_behaviour, QuackVariant quack_behaviour)
+        : fly_behaviour_(fly_behaviour), quack_behaviour_(quack_behaviour)
+    {
+    }
+    void performFly()
+    {
+        std::visit([](auto& fb) { using Behaviour = std::decay_t<decltype(fb)>; fb.Behaviour::Fly(); }, fly_behaviour_);
+    }
+    void performQuack()
+    {
+        std::visit([](auto& qb) { using Behaviour = std::decay_t<decltype(qb)>; qb.Behaviour::quack(); }, quack_behaviour_);
+    }
+    void swim()
+    {
+        std::cout << "I can swim\n";
+    }
+    template<class Behaviour>
+    void setFlyBehaviour(Behaviour fb)
+    {
+        fly_behaviour_ = fb;
+    }
+    template<class Behaviour>
+    void setQuackBehaviour(Behaviour qb)
+    {
+        quack_behaviour_ = qb;
+    }
+protected:
+    FlyVariant fly_behaviour_;
+    QuackVariant quack_behaviour_;
+};
+
+using KnownFlyBehaviour = std::variant<FlyWithWings, FlyNoWay>;
+using KnownQuackBehaviour = std::variant<Quack, MuteQuack>;
+
+class StaticMallardDuck : public StaticDuck<KnownFlyBehaviour, KnownQuackBehaviour>
+{
+public:
+    StaticMallardDuck() : StaticDuck(FlyWithWings(), Quack())
+    {
+    }
+    void display()
+    {
+        std::cout << "I am Mallard Duck\n";
+    }
+};
+
+// Holds several interchangeable implementations of one strategy interface and sends calls to whichever
+// has lately been fastest. One call in sample_every is timed. During a probe every candidate is timed
+// probe_samples times in turn; afterwards only the current one is, and a new probe starts after
+// reprobe_after timed calls. A challenger replaces the current strategy only if it is faster by more
+// than the hysteresis fraction, so two candidates of similar speed do not flap.
+// Candidates are borrowed and must outlive the selector. invoke() may be called from several threads;
+// untimed calls decrement a thread-local countdown and take one relaxed load of the current choice, timed
+// calls also take a mutex. The countdown is reloaded with a random gap averaging sample_every, so threads
+// sharing it between several selectors do not always time the same one. With no candidates invoke() does
+// nothing and current() returns nullptr; a sample_every of 0 is taken as 1.
+template<class Strategy>
+class AdaptiveStrategy
+{
+public:
+    struct Options
+    {
+        unsigned sample_every = 16;
+        unsigned probe_samples = 8;
+        unsigned reprobe_after = 4096;
+        double hysteresis = 0.10;
+    };
+
+    AdaptiveStrategy() = default;
+    explicit AdaptiveStrategy(Options options) : options_(options)
+    {
+        if (options_.sample_every == 0)
+            options_.sample_every = 1;
+    }
+
+    // Candidates must all be added before the first invoke()
+    void add(Strategy* candidate)
+    {
+        candidates_.push_back({ candidate, 0.0, 0 });
+    }
+    Strategy* current() const
+    {
+        if (candidates_.empty())
+            return nullptr;
+        return candidates_[current_.load(std::memory_order_relaxed)].strategy;
+    }
+
+    // Runs call(strategy) on the chosen candidate
+    template<class Call>
+    void invoke(Call&& call)
+    {
+        static thread_local unsigned countdown = 0;
+        if (candidates_.empty())
+            return;
+        if (countdown > 1)
+        {
+            --countdown;
+            call(*candidates_[current_.load(std::memory_order_relaxed)].strategy);
+            return;
+        }
+        countdown = nextGap();
+        std::size_t index = nextSample();
+        auto start = std::chrono::steady_clock::now();
+        call(*candidates_[index].strategy);
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        record(index, elapsed.count());
+    }
+
+private:
+    struct Candidate
+    {
+        Strategy* strategy;
+        double average_ns;  // exponentially weighted moving average of timed calls
+        unsigned samples;   // timed calls in the current probe
+    };
+
+    // A gap in [1, 2 * sample_every - 1], so one call in sample_every is timed on average
+    unsigned nextGap() const
+    {
+        static thread_local std::uint32_t state = 0x9E3779B9u;
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return 1 + static_cast<unsigned>(state % (2ull * options_.sample_every - 1));
+    }
+    std::size_t nextSample()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return probing_ ? probe_index_ : current_.load(std::memory_order_relaxed);
+    }
+    void record(std::size_t index, double ns)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Candidate& candidate = candidates_[index];
+        candidate.average_ns = candidate.samples == 0 && candidate.average_ns == 0.0 ? ns : 0.75 * candidate.average_ns + 0.25 * ns;
+        ++candidate.samples;
+        if (!probing_)
+        {
+            if (++since_probe_ >= options_.reprobe_after)
+                startProbe();
+            return;
+        }
+        if (index != probe_index_ || candidate.samples < options_.probe_samples)
+            return;
+        if (++probe_index_ < candidates_.size())
+            return;
+
+        // Probe finished: switch only if the best challenger clearly beats the current strategy
+        std::size_t current = current_.load(std::memory_order_relaxed);
+        std::size_t best = current;
+        for (std::size_t i = 0; i < candidates_.size(); ++i)
+            if (candidates_[i].average_ns < candidates_[best].average_ns)
+                best = i;
+        if (best != current && candidates_[best].average_ns < candidates_[current].average_ns * (1.0 - options_.hysteresis))
+            current_.store(best, std::memory_order_relaxed);
+        probing_ = false;
+        since_probe_ = 0;
+    }
+    void startProbe()
+    {
+        for (Candidate& c : candidates_)
+            c.samples = 0;
+        probing_ = true;
+        probe_index_ = 0;
+    }
+
+    Options options_;
+    std::vector<Candidate> candidates_;
+    std::atomic<std::size_t> current_{ 0 };
+    std::mutex mutex_;
+    bool probing_ = true;
+    std::size_t probe_index_ = 0;
+    unsigned since_probe_ = 0;
+};
+
+// A FlyBehaviour that lets an AdaptiveStrategy pick among several fly behaviours, so a Duck uses
+// whichever is fastest without knowing there is a choice
+class AdaptiveFlyBehaviour : public FlyBehaviour
+{
+public:
+    AdaptiveFlyBehaviour() = default;
+    explicit AdaptiveFlyBehaviour(AdaptiveStrategy<FlyBehaviour>::Options options) : selector_(options) {}
+    void addCandidate(FlyBehaviour* fb)
+    {
+        selector_.add(fb);
+    }
+    FlyBehaviour* current() const { return selector_.current(); }
+    void Fly()
+    {
+        selector_.invoke([](FlyBehaviour& fb) { fb.Fly(); });
+    }
+private:
+    AdaptiveStrategy<FlyBehaviour> selector_;
+};
+
+// Opt-in instrumentation: build with STRATEGY_INSTRUMENTATION defined and pass strategies through
+// instrument() to count calls and record a latency histogram per concrete strategy type. Without the
+// macro instrument() returns its argument, so the Duck hot path is exactly the uninstrumented one.
+#if defined(STRATEGY_INSTRUMENTATION)
+class StrategyStats
+{
+public:
+    static constexpr int kMaxTypes = 64;
+    static constexpr int kBuckets = 32;   // bucket b holds calls that took [2^b, 2^(b+1)) ns
+
+    // Times one call and records it against a strategy type when it goes out of scope
+    class Timer
+    {
+    public:
+        explicit Timer(int slot) : slot_(slot), start_(std::chrono::steady_clock::now()) {}
+        ~Timer()
+        {
+            std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start_;
+            record(slot_, static_cast<std::uint64_t>(elapsed.count()));
+        }
+    private:
+        int slot_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+    // Slot of a concrete strategy type; called when a wrapper is created, not per call
+    static int typeSlot(const std::type_info& type)
+    {
+        Types& types = registeredTypes();
+        std::lock_guard<std::mutex> lock(types.mutex);
+        for (int i = 0; i < types.count; ++i)
+            if (*types.types[i] == type)
+                return i;
+        if (types.count == kMaxTypes)
+            return kMaxTypes - 1;
+        types.types[types.count] = &type;
+        return types.count++;
+    }
+    // Only the owning thread writes its counters, so plain load/store pairs are enough (no locked RMW)
+    static void record(int slot, std::uint64_t ns)
+    {
+        Counters& c = localCounters();
+        int bucket = 0;
+        while (bucket + 1 < kBuckets && (ns >> (bucket + 1)) != 0)
+            ++bucket;
+        bump(c.calls[slot], 1);
+        bump(c.total_ns[slot], ns);
+        bump(c.histogram[slot][bucket], 1);
+    }
+    // Merges the counters of every thread, including threads that have exited
+    static void report(std::ostream& out)
+    {
+        Types& types = registeredTypes();
+        std::lock_guard<std::mutex> lock(types.mutex);
+        for (int slot = 0; slot < types.count; ++slot)
+        {
+            std::uint64_t calls = 0, total_ns = 0, histogram[kBuckets] = {};
+            for (Counters* c = threads().load(std::memory_order_acquire); c != nullptr; c = c->next)
+            {
+                calls += c->calls[slot].load(std::memory_order_relaxed);
+                total_ns += c->total_ns[slot].load(std::memory_order_relaxed);
+                for (int b = 0; b < kBuckets; ++b)
+                    histogram[b] += c->histogram[slot][b].load(std::memory_order_relaxed);
+            }
+            if (calls == 0)
+                continue;
+            printTypeName(out, *types.types[slot]);
+            out << ": " << calls << " calls, mean " << total_ns / calls
+                << " ns, p50 < " << percentile(histogram, calls, 0.50) << " ns, p99 < "
+                << percentile(histogram, calls, 0.99) << " ns\n";
+        }
+    }
+
+private:
+    struct alignas(64) Counters
+    {
+        std::atomic<std::uint64_t> calls[kMaxTypes] = {};
+        std::atomic<std::uint64_t> total_ns[kMaxTypes] = {};
+        std::atomic<std::uint64_t> histogram[kMaxTypes][kBuckets] = {};
+        Counters* next = nullptr;
+    };
+    struct Types
+    {
+        std::mutex mutex;
+        const std::type_info* types[kMaxTypes] = {};
+        int count = 0;
+    };
+
+    // GCC and Clang return mangled names from type_info::name(); MSVC's are already readable
+    static void printTypeName(std::ostream& out, const std::type_info& type)
+    {
+#if defined(__GNUC__)
+        int status = 0;
+        char* demangled = abi::__cxa_demangle(type.name(), nullptr, nullptr, &status);
+        if (status == 0 && demangled != nullptr)
+        {
+            out << demangled;
+            std::free(demangled);
+            return;
+        }
+#endif
+        out << type.name();
+    }
+    static void bump(std::atomic<std::uint64_t>& counter, std::uint64_t by)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+    }
+    // Upper bound of the bucket that holds the given fraction of calls
+    static std::uint64_t percentile(const std::uint64_t* histogram, std::uint64_t calls, double fraction)
+    {
+        std::uint64_t seen = 0;
+        for (int b = 0; b < kBuckets; ++b)
+        {
+            seen += histogram[b];
+            if (seen >= fraction * calls)
+                return std::uint64_t(2) << b;
+        }
+        return std::uint64_t(2) << (kBuckets - 1);
+    }
+    static Types& registeredTypes()
+    {
+        static Types types;
+        return types;
+    }
+    static std::atomic<Counters*>& threads()
+    {
+        static std::atomic<Counters*> head(nullptr);
+        return head;
+    }
+    // Each thread's counters are pushed onto a lock-free list once and kept after the thread exits
+    static Counters& localCounters()
+    {
+        thread_local Counters* counters = nullptr;
+        if (counters == nullptr)
+        {
+            counters = new Counters();
+            counters->next = threads().load(std::memory_order_relaxed);
+            while (!threads().compare_exchange_weak(counters->next, counters, std::memory_order_acq_rel))
+            {
+            }
+        }
+        return *counters;
+    }
+};
+
+// Forwarding wrappers, one per strategy interface. Another interface is instrumented by adding a
+// specialization whose methods time the call with a StrategyStats::Timer.
+template<class Interface>
+class Instrumented;
+
+template<>
+class Instrumented<FlyBehaviour> : public FlyBehaviour
+{
+public:
+    explicit Instrumented(FlyBehaviour* inner) : inner_(inner), slot_(StrategyStats::typeSlot(typeid(*inner))) {}
+    void Fly()
+    {
+        StrategyStats::Timer timer(slot_);
+        inner_->Fly();
+    }
+private:
+    FlyBehaviour* inner_;
+    int slot_;
+};
+
+template<>
+class Instrumented<QuackBehaviour> : public QuackBehaviour
+{
+public:
+    explicit Instrumented(QuackBehaviour* inner) : inner_(inner), slot_(StrategyStats::typeSlot(typeid(*inner))) {}
+    void quack()
+    {
+        StrategyStats::Timer timer(slot_);
+        inner_->quack();
+    }
+private:
+    QuackBehaviour* inner_;
+    int slot_;
+};
+
+// Returns the wrapper of strategy, creating it on first use. Wrappers are immortal and shared per
+// strategy, so instrumenting a flyweight does not allocate per duck; like the flyweight, the result is
+// borrowed by the duck. Wrappers are looked up by address and dynamic type: a strategy freed and
+// replaced by one of another type at the same address gets a new wrapper, so its calls are not counted
+// under the old type. The old wrapper is left alive, because a duck may still hold it.
+template<class Interface>
+Interface* instrument(Interface* strategy)
+{
+    struct Wrapper
+    {
+        Interface* strategy;
+        const std::type_info* type;
+        Interface* wrapper;
+    };
+    static std::mutex mutex;
+    static std::vector<Wrapper> wrappers;
+    const std::type_info& type = typeid(*strategy);
+    std::lock_guard<std::mutex> lock(mutex);
+    for (Wrapper& w : wrappers)
+    {
+        if (w.strategy != strategy)
+            continue;
+        if (*w.type != type)
+        {
+            w.type = &type;
+            w.wrapper = new Instrumented<Interface>(strategy);
+        }
+        return w.wrapper;
+    }
+    Interface* wrapper = new Instrumented<Interface>(strategy);
+    wrappers.push_back({ strategy, &type, wrapper });
+    return wrapper;
+}
+#else
+template<class Interface>
+Interface* instrument(Interface* strategy)
+{
+    return strategy;
+}
+#endif
+
+// Benchmark behaviours do a trivial amount of work, so the timings show the cost of dispatch rather
+// than of writing to std::cout
+static long g_benchmark_work = 0;
+class BenchmarkGlide : public FlyBehaviour
+{
+public:
+    void Fly() { g_benchmark_work += 1; }
+};
+class BenchmarkFlap : public FlyBehaviour
+{
+public:
+    void Fly() { g_benchmark_work += 2; }
+};
+class BenchmarkDuck : public Duck
+{
+public:
+    BenchmarkDuck(FlyBehaviour* fb) { fly_behaviour_ = fb; }
+    void display() {}
+};
+
+// The benchmarks are built only with STRATEGY_BENCHMARKS defined: they take a while, and
+// measureFlyweightSaving() replaces the program's global allocation functions to count heap allocations.
+#if defined(STRATEGY_BENCHMARKS)
+// Calls performFly() on every duck of a population, with the two behaviours interleaved, through the
+// virtual Duck and through StaticDuck
+void benchmarkStaticDuck(std::size_t ducks = 2000000, int rounds = 10)
+{
+    using Clock = std::chrono::steady_clock;
+    std::vector<std::unique_ptr<FlyBehaviour>> behaviours;
+    std::vector<std::unique_ptr<Duck>> virtual_ducks;
+    std::vector<StaticDuck<std::variant<BenchmarkGlide, BenchmarkFlap>, KnownQuackBehaviour>> static_ducks;
+    for (std::size_t i = 0; i < ducks; ++i)
+    {
+        if (i % 3 == 0)
+        {
+            behaviours.emplace_back(new BenchmarkGlide());
+            static_ducks.emplace_back(BenchmarkGlide(), Quack());
+        }
+        else
+        {
+            behaviours.emplace_back(new BenchmarkFlap());
+            static_ducks.emplace_back(BenchmarkFlap(), Quack());
+        }
+        virtual_ducks.emplace_back(new BenchmarkDuck(behaviours.back().get()));
+    }
+
+    g_benchmark_work = 0;
+    auto start = Clock::now();
+    for (int round = 0; round < rounds; ++round)
+        for (auto& duck : virtual_ducks)
+            duck->performFly();
+    std::chrono::duration<double, std::milli> virtual_ms = Clock::now() - start;
+    long virtual_work = g_benchmark_work;
+
+    g_benchmark_work = 0;
+    start = Clock::now();
+    for (int round = 0; round < rounds; ++round)
+        for (auto& duck : static_ducks)
+            duck.performFly();
+    std::chrono::duration<double, std::milli> static_ms = Clock::now() - start;
+
+    std::cout << ducks * rounds << " performFly calls: virtual Duck " << virtual_ms.count() << " ms (" << virtual_work
+        << "), StaticDuck " << static_ms.count() << " ms (" << g_benchmark_work << ")\n";
+}
+
+#include "CountingAllocator.h"
+
+// Builds a population of mallards with a strategy object per duck and with shared flyweights, and
+// reports what each costs on the heap (the allocator's own per-block overhead comes on top)
+void measureFlyweightSaving(std::size_t ducks = 1000000)
+{
+    std::vector<std::unique_ptr<FlyBehaviour>> fly_behaviours;
+    std::vector<std::unique_ptr<QuackBehaviour>> quack_behaviours;
+    std::vector<std::unique_ptr<Duck>> population;
+    fly_behaviours.reserve(ducks);
+    quack_behaviours.reserve(ducks);
+    population.reserve(ducks);
+
+    std::size_t allocations = t_allocation_count;
+    std::size_t bytes = t_allocated_bytes;
+    for (std::size_t i = 0; i < ducks; ++i)
+    {
+        fly_behaviours.emplace_back(new FlyWithWings());
+        quack_behaviours.emplace_back(new Quack());
+        population.emplace_back(new MallardDuck());
+        population.back()->setFlyBehaviour(fly_behaviours.back().get());
+        population.back()->setQuackBehaviour(quack_behaviours.back().get());
+    }
+    std::cout << "per-duck strategies: " << t_allocation_count - allocations << " allocations, "
+        << t_allocated_bytes - bytes << " bytes\n";
+    population.clear();
+    fly_behaviours.clear();
+    quack_behaviours.clear();
+
+    allocations = t_allocation_count;
+    bytes = t_allocated_bytes;
+    for (std::size_t i = 0; i < ducks; ++i)
+        population.emplace_back(new MallardDuck());
+    std::cout << "shared flyweights:   " << t_allocation_count - allocations << " allocations, "
+        << t_allocated_bytes - bytes << " bytes\n";
+}
+#endif
+
+// Readers call performFly() on one shared duck while swappers keep replacing its (owned) fly behaviour.
+// Each behaviour counts its own flights, so a reader calling into a reclaimed strategy would be a
+// use-after-free (run under AddressSanitizer/ThreadSanitizer to catch it). At the end every swapped-out
+// strategy must have been reclaimed.
+class StressFly : public FlyBehaviour
+{
+public:
+    StressFly() { live.fetch_add(1, std::memory_order_relaxed); }
+    ~StressFly() { live.fetch_sub(1, std::memory_order_relaxed); }
+    void Fly() { flights.fetch_add(1, std::memory_order_relaxed); }
+    std::atomic<long> flights{ 0 };
+    static std::atomic<long> live;
+};
+std::atomic<long> StressFly::live(0);
+
+bool stressStrategySwap(int readers = 4, int swappers = 2, int milliseconds = 500)
+{
+    MallardDuck duck;
+    duck.setFlyBehaviour(std::unique_ptr<FlyBehaviour>(new StressFly()));
+    std::atomic<bool> stop(false);
+    std::atomic<long> calls(0);
+    std::atomic<long> swaps(0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < readers; ++i)
+        threads.emplace_back([&] {
+            long n = 0;
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                duck.performFly();
+                ++n;
+            }
+            calls += n;
+        });
+    for (int i = 0; i < swappers; ++i)
+        threads.emplace_back([&] {
+            long n = 0;
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                duck.setFlyBehaviour(std::unique_ptr<FlyBehaviour>(new StressFly()));
+                ++n;
+            }
+            swaps += n;
+        });
+    std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
+    stop = true;
+    for (std::thread& t : threads)
+        t.join();
+
+    // With no readers left, two collections advance the epoch far enough to reclaim everything retired
+    EpochReclaimer::collect();
+    EpochReclaimer::collect();
+    bool ok = StressFly::live.load() == 1;
+    std::cout << calls << " performFly calls during " << swaps << " swaps, " << StressFly::live.load()
+        << " strategies alive afterwards (" << (ok ? "ok" : "LEAK") << ")\n";
+    return ok;
+}
+
+// Two fly behaviours doing the same job at different speeds; the adaptive behaviour should settle on
+// the faster one even though the slower one is registered first
+class SpinFly : public FlyBehaviour
+{
+public:
+    explicit SpinFly(int spins) : spins_(spins) {}
+    void Fly()
+    {
+        for (int i = 0; i < spins_; ++i)
+            g_benchmark_work += i;
+    }
+private:
+    int spins_;
+};
+
+void demoAdaptiveStrategy(int calls = 100000)
+{
+    SpinFly slow(2000);
+    SpinFly fast(50);
+    std::unique_ptr<AdaptiveFlyBehaviour> adaptive(new AdaptiveFlyBehaviour());
+    adaptive->addCandidate(&slow);
+    adaptive->addCandidate(&fast);
+    AdaptiveFlyBehaviour* selector = adaptive.get();
+
+    MallardDuck duck;
+    duck.setFlyBehaviour(std::move(adaptive));
+    for (int i = 0; i < calls; ++i)
+        duck.performFly();
+    std::cout << "adaptive fly behaviour settled on the " << (selector->current() == &fast ? "fast" : "slow") << " candidate\n";
+}
+
 /*int main()
 {
     Duck* mallard = new MallardDuck();
@@ -136,10 +1210,39 @@ public:
     mallard->performQuack();
 
     std::cout << "changing behaviour dynamically\n";
-    mallard->setFlyBehaviour(new FlyNoWay());
-    mallard->setQuackBehaviour(new MuteQuack());
+    mallard->setFlyBehaviour(StrategyRegistry::shared<FlyNoWay>());
+    mallard->setQuackBehaviour(StrategyRegistry::shared<MuteQuack>());
+    mallard->performFly();
+    mallard->performQuack();
+
+    StaticMallardDuck static_mallard;
+    static_mallard.display();
+    static_mallard.performFly();
+    static_mallard.setFlyBehaviour(FlyNoWay());
+    static_mallard.performFly();
+#if defined(STRATEGY_BENCHMARKS)
+    benchmarkStaticDuck();
+    measureFlyweightSaving();
+#endif
+
+    DuckPopulation pond;
+    MallardDuck mallards[4];
+    for (MallardDuck& duck : mallards)
+        pond.add(&duck);
+    pond.setFlyBehaviour(1, StrategyRegistry::shared<FlyNoWay>());
+    pond.performFlyAll();
+    pond.performQuackAll();
+
+    stressStrategySwap();
+    demoAdaptiveStrategy();
+
+    mallard->setFlyBehaviour(instrument<FlyBehaviour>(StrategyRegistry::shared<FlyWithWings>()));
+    mallard->setQuackBehaviour(instrument<QuackBehaviour>(StrategyRegistry::shared<Quack>()));
     mallard->performFly();
     mallard->performQuack();
+#if defined(STRATEGY_INSTRUMENTATION)
+    StrategyStats::report(std::cout);
+#endif
 }*/
 
 // Run program: Ctrl + F5 or Debug > Start Without Debugging menu
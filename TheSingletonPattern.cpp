@@ -41,33 +41,271 @@
 //	You cannot subclass a singleton class, because its constructor is private. You cannot extend a class
 //	with private constructor. So you have to move the contructor to protected or public, and hence
 //	it is really no more a singleton class as other classes can instantiate it.
+//
+// The Singleton below combines the first and third mechanisms without their costs: std::call_once builds
+// the instance on first use, and afterwards getInstance() is a single acquire load of the published
+// pointer, which on x86 is a plain load with no fence and no lock.
 #include<iostream>
+#include<atomic>
+#include<chrono>
+#include<cstdint>
+#include<functional>
+#include<initializer_list>
+#include<memory>
+#include<mutex>
+#include<new>
+#include<string_view>
+#include<thread>
+#include<vector>
+
+// A counter that many threads bump at once. Each thread adds to its own cache-line-sized shard, so hot
+// callers never bounce a shared line between cores; reading adds the shards up.
+class ShardedCounter
+{
+public:
+	static constexpr std::size_t kShards = 64;
+
+	void add(std::uint64_t amount = 1)
+	{
+		shards_[shardIndex()].value.fetch_add(amount, std::memory_order_relaxed);
+	}
+	// Exact once the adding threads are quiet; otherwise a value the counter passed through
+	std::uint64_t value() const
+	{
+		std::uint64_t total = 0;
+		for (const Shard& shard : shards_)
+			total += shard.value.load(std::memory_order_relaxed);
+		return total;
+	}
+
+private:
+	struct alignas(64) Shard
+	{
+		std::atomic<std::uint64_t> value{ 0 };
+	};
+
+	// Threads take shards round robin; past kShards threads, some share a shard, which stays correct
+	static std::size_t shardIndex()
+	{
+		static std::atomic<std::size_t> next_thread(0);
+		thread_local std::size_t index = next_thread.fetch_add(1, std::memory_order_relaxed) % kShards;
+		return index;
+	}
+
+	Shard shards_[kShards];
+};
 
 class Singleton
 {
 private:
-	static Singleton* unique_instance;
-	int i = 0;
+	static std::atomic<Singleton*> unique_instance;
+	ShardedCounter i;
 	Singleton() {}
+	// Kept out of getInstance() so the fast path stays small enough to inline
+	static Singleton* create()
+	{
+		static std::once_flag once;
+		std::call_once(once, [] { unique_instance.store(new Singleton(), std::memory_order_release); });
+		return unique_instance.load(std::memory_order_acquire);
+	}
 public:
 	static Singleton* getInstance()
 	{
-		if (unique_instance == nullptr)
-			unique_instance = new Singleton();
-		return unique_instance;
+		if (Singleton* instance = unique_instance.load(std::memory_order_acquire))
+			return instance;
+		return create();
 	}
 	void print()
 	{
-		i++;
-		std::cout << i << "\n";
+		i.add();
+		std::cout << i.value() << "\n";
 	}
 };
 
-Singleton* Singleton::unique_instance = nullptr;
+std::atomic<Singleton*> Singleton::unique_instance(nullptr);
+
+// Names a service registered with a ServiceRegistry; id is kNoService if registration failed
+template<class T>
+struct ServiceHandle
+{
+	std::size_t id;
+};
+
+// Many process-wide services built the way Singleton builds its instance (once, on first use, with a
+// single load afterwards), but owned by a registry so they can also be destroyed in an orderly way.
+// - A service lists the services it depends on, which must be registered before it, so the graph has no
+//   cycles. They are built before the service itself.
+// - startWarmUp() builds every service on background threads. Each thread calls get() in registration
+//   order, so independent services are built in parallel and a thread that needs a dependency under
+//   construction waits for it.
+// - shutdown() (also run by the destructor) destroys the services in the reverse of the order they
+//   finished building, so every service goes before the services it depends on.
+// - printReport() lists how long each service took to build, not counting its dependencies.
+// Register every service before the first get(), from one thread.
+class ServiceRegistry
+{
+public:
+	static constexpr std::size_t kMaxServices = 256;
+	static constexpr std::size_t kNoService = static_cast<std::size_t>(-1);
+
+	// The registry for the whole process; its services are destroyed at exit
+	static ServiceRegistry& global()
+	{
+		static ServiceRegistry registry;
+		return registry;
+	}
+
+	ServiceRegistry() = default;
+	ServiceRegistry(const ServiceRegistry&) = delete;
+	ServiceRegistry& operator=(const ServiceRegistry&) = delete;
+	~ServiceRegistry()
+	{
+		waitForWarmUp();
+		shutdown();
+	}
+
+	// build may call get() for the dependencies and returns the new service, or nullptr if it failed.
+	// name must outlive the registry (a string literal).
+	template<class T>
+	ServiceHandle<T> add(std::string_view name, std::function<T*(ServiceRegistry&)> build,
+		std::initializer_list<std::size_t> dependencies = {})
+	{
+		std::size_t id = count_.load(std::memory_order_relaxed);
+		if (id == kMaxServices || !build)
+			return { kNoService };
+		for (std::size_t dependency : dependencies)
+			if (dependency >= id)
+				return { kNoService };
+		std::unique_ptr<Service> service(new(std::nothrow) Service());
+		if (service == nullptr)
+			return { kNoService };
+		service->name = name;
+		service->dependencies.assign(dependencies.begin(), dependencies.end());
+		service->build = [build](ServiceRegistry& registry) -> void* { return build(registry); };
+		service->destroy = [](void* instance) { delete static_cast<T*>(instance); };
+		services_[id] = std::move(service);
+		count_.store(id + 1, std::memory_order_release);
+		return { id };
+	}
+
+	// Builds the service and its dependencies on first use; nullptr if it could not be built.
+	// After that it is a single acquire load.
+	template<class T>
+	T* get(ServiceHandle<T> handle)
+	{
+		if (handle.id >= count_.load(std::memory_order_acquire))
+			return nullptr;
+		if (void* instance = services_[handle.id]->instance.load(std::memory_order_acquire))
+			return static_cast<T*>(instance);
+		return static_cast<T*>(ensure(handle.id));
+	}
+
+	// Builds every service not built yet on threads background threads; returns at once
+	void startWarmUp(unsigned threads = std::thread::hardware_concurrency())
+	{
+		std::lock_guard<std::mutex> lock(warm_up_mutex_);
+		if (!warm_up_threads_.empty())
+			return;
+		next_to_warm_.store(0, std::memory_order_relaxed);
+		for (unsigned t = 0; t < (threads ? threads : 1); ++t)
+		{
+			warm_up_threads_.emplace_back([this]
+			{
+				std::size_t count = count_.load(std::memory_order_acquire);
+				for (std::size_t id = next_to_warm_.fetch_add(1, std::memory_order_relaxed); id < count;
+					id = next_to_warm_.fetch_add(1, std::memory_order_relaxed))
+					ensure(id);
+			});
+		}
+	}
+	void waitForWarmUp()
+	{
+		std::lock_guard<std::mutex> lock(warm_up_mutex_);
+		for (std::thread& thread : warm_up_threads_)
+			thread.join();
+		warm_up_threads_.clear();
+	}
+
+	// Destroys the built services, dependents first. No get() may run at the same time or afterwards.
+	void shutdown()
+	{
+		std::lock_guard<std::mutex> lock(completed_mutex_);
+		for (auto id = completed_.rbegin(); id != completed_.rend(); ++id)
+		{
+			Service& service = *services_[*id];
+			if (void* instance = service.instance.exchange(nullptr, std::memory_order_acq_rel))
+				service.destroy(instance);
+		}
+		completed_.clear();
+	}
+
+	void printReport(std::ostream& out)
+	{
+		std::lock_guard<std::mutex> lock(completed_mutex_);
+		for (std::size_t id : completed_)
+		{
+			const Service& service = *services_[id];
+			out << service.name << ": " << service.build_ns / 1000.0 << " us"
+				<< (service.instance.load(std::memory_order_acquire) ? "" : " (failed)") << "\n";
+		}
+	}
+
+private:
+	struct Service
+	{
+		std::string_view name;
+		std::vector<std::size_t> dependencies;
+		std::function<void*(ServiceRegistry&)> build;
+		void (*destroy)(void*) = nullptr;
+		std::once_flag once;
+		std::atomic<void*> instance{ nullptr };
+		std::uint64_t build_ns = 0;  // written inside call_once, read after it
+	};
+
+	void* ensure(std::size_t id)
+	{
+		Service& service = *services_[id];
+		for (std::size_t dependency : service.dependencies)
+			ensure(dependency);
+		std::call_once(service.once, [this, id, &service]
+		{
+			auto begin = std::chrono::steady_clock::now();
+			void* instance = service.build(*this);
+			service.build_ns = static_cast<std::uint64_t>(
+				std::chrono::nanoseconds(std::chrono::steady_clock::now() - begin).count());
+			std::lock_guard<std::mutex> lock(completed_mutex_);
+			completed_.push_back(id);
+			service.instance.store(instance, std::memory_order_release);
+		});
+		return service.instance.load(std::memory_order_acquire);
+	}
+
+	std::unique_ptr<Service> services_[kMaxServices];
+	std::atomic<std::size_t> count_{ 0 };
+	std::mutex completed_mutex_;
+	std::vector<std::size_t> completed_;  // ids in the order their build finished
+	std::mutex warm_up_mutex_;
+	std::vector<std::thread> warm_up_threads_;
+	std::atomic<std::size_t> next_to_warm_{ 0 };
+};
 /*int main()
 {
 	Singleton* obj1 = Singleton::getInstance();
 	obj1->print();
 	Singleton* obj2 = Singleton::getInstance();
 	obj2->print();
+
+	struct Config { Config() { std::cout << "Config up\n"; } ~Config() { std::cout << "Config down\n"; } };
+	struct Logger { Logger() { std::cout << "Logger up\n"; } ~Logger() { std::cout << "Logger down\n"; } };
+	struct Database { Database() { std::cout << "Database up\n"; } ~Database() { std::cout << "Database down\n"; } };
+	ServiceRegistry& services = ServiceRegistry::global();
+	ServiceHandle<Config> config = services.add<Config>("config", [](ServiceRegistry&) { return new Config(); });
+	ServiceHandle<Logger> logger = services.add<Logger>("logger", [](ServiceRegistry&) { return new Logger(); },
+		{ config.id });
+	ServiceHandle<Database> database = services.add<Database>("database",
+		[](ServiceRegistry&) { return new Database(); }, { config.id, logger.id });
+	services.startWarmUp(2);
+	services.get(database);
+	services.waitForWarmUp();
+	services.printReport(std::cout);
 }*/
\ No newline at end of file